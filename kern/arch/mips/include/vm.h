@@ -67,6 +67,9 @@
  */
 #define PADDR_TO_KVADDR(paddr) ((paddr)+MIPS_KSEG0)
 
+/* And the reverse, for addresses handed out by alloc_kpages. */
+#define KVADDR_TO_PADDR(vaddr) ((vaddr)-MIPS_KSEG0)
+
 /*
  * The top of user space. (Actually, the address immediately above the
  * last valid user address.)
@@ -83,6 +86,14 @@
  */
 #define USERSTACK     USERSPACETOP
 
+/*
+ * The kernel virtual allocator (vmalloc) maps pages at the bottom of
+ * kseg2. Misses there go to the general exception vector, not the
+ * UTLB one, so they end up in vm_fault.
+ */
+#define VMALLOC_BASE    MIPS_KSEG2
+#define VMALLOC_NPAGES  4096		/* 16M of address space */
+
 /*
  * Interface to the low-level module that looks after the amount of
  * physical memory we have.
@@ -109,10 +120,7 @@ void ram_getsize(paddr_t *lo, paddr_t *hi);
  */
 
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	struct addrspace *ts_addrspace;
+	unsigned ts_asid;	/* ASID the page was mapped with */
 	vaddr_t ts_vaddr;
 };
 
@@ -31,10 +31,12 @@
 #include <kern/errno.h>
 #include <kern/syscall.h>
 #include <lib.h>
+#include <copyinout.h>
 #include <mips/trapframe.h>
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
+#include "opt-dumbvm.h"
 
 
 /*
@@ -81,6 +83,10 @@ syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	int err;
+#if !OPT_DUMBVM
+	int32_t fd;
+	off_t offset;
+#endif
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -129,6 +135,67 @@ syscall(struct trapframe *tf)
 			    (int)tf->tf_a2,
 			    (pid_t *)&retval);
 	  break;
+#if !OPT_DUMBVM
+	case SYS_sbrk:
+	  err = sys_sbrk((intptr_t)tf->tf_a0,
+			 (vaddr_t *)&retval);
+	  break;
+	case SYS_mmap:
+	  /* fd and the (aligned) 64-bit offset are on the stack */
+	  err = copyin((const_userptr_t)(tf->tf_sp + 16), &fd, sizeof(fd));
+	  if (err == 0) {
+	    err = copyin((const_userptr_t)(tf->tf_sp + 24),
+			 &offset, sizeof(offset));
+	  }
+	  if (err == 0) {
+	    err = sys_mmap((userptr_t)tf->tf_a0,
+			   (size_t)tf->tf_a1,
+			   (int)tf->tf_a2,
+			   (int)tf->tf_a3,
+			   fd, offset,
+			   (vaddr_t *)&retval);
+	  }
+	  break;
+	case SYS_munmap:
+	  err = sys_munmap((userptr_t)tf->tf_a0,
+			   (size_t)tf->tf_a1);
+	  break;
+	case SYS_msync:
+	  err = sys_msync((userptr_t)tf->tf_a0,
+			  (size_t)tf->tf_a1,
+			  (int)tf->tf_a2);
+	  break;
+	case SYS_madvise:
+	  err = sys_madvise((userptr_t)tf->tf_a0,
+			    (size_t)tf->tf_a1,
+			    (int)tf->tf_a2);
+	  break;
+	case SYS_mincore:
+	  err = sys_mincore((userptr_t)tf->tf_a0,
+			    (size_t)tf->tf_a1,
+			    (userptr_t)tf->tf_a2);
+	  break;
+	case SYS_shmget:
+	  err = sys_shmget((int)tf->tf_a0,
+			   (size_t)tf->tf_a1,
+			   (int)tf->tf_a2,
+			   (int *)&retval);
+	  break;
+	case SYS_shmat:
+	  err = sys_shmat((int)tf->tf_a0,
+			  (userptr_t)tf->tf_a1,
+			  (int)tf->tf_a2,
+			  (vaddr_t *)&retval);
+	  break;
+	case SYS_shmdt:
+	  err = sys_shmdt((userptr_t)tf->tf_a0);
+	  break;
+	case SYS_shmctl:
+	  err = sys_shmctl((int)tf->tf_a0,
+			   (int)tf->tf_a1,
+			   (userptr_t)tf->tf_a2);
+	  break;
+#endif
 #endif // UW
 
 	    /* Add stuff here */
@@ -0,0 +1,1251 @@
+/*
+ * MIPS side of the demand-paged VM system: fault handling, TLB
+ * management, and kernel page allocation.
+ *
+ * vm_fault looks the faulting address up in the current address
+ * space's regions and page table. A page that has never been touched
+ * gets a fresh zero-filled frame (from the pool of pages zeroed while
+ * idle, if possible) or is read from the executable; either way the mapping is then
+ * loaded into the TLB. A write to a copy-on-write page (resident, in
+ * a writable region, but mapped read-only) gets its own copy first.
+ * A page that was paged out is read back from swap. Pages of a
+ * MAP_SHARED file mapping are the page cache's frames, mapped
+ * read-only until the first write so we know which ones are dirty.
+ * Kernel misses in kseg2 are vmalloc'd pages; see vmalloc.h.
+ *
+ * See swap.c for how this synchronizes with the page-out daemon.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <proc.h>
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <platform/maxcpus.h>
+#include <mips/tlb.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <swap.h>
+#include <zeropool.h>
+#include <pagecache.h>
+#include <shm.h>
+#include <vmalloc.h>
+#include <uw-vmstats.h>
+#include "opt-tlbroundrobin.h"
+#include "opt-tlbsecondchance.h"
+
+void
+vm_bootstrap(void)
+{
+	coremap_bootstrap();
+	zeropool_bootstrap();
+	pagecache_bootstrap();
+	shm_bootstrap();
+	vmstats_init();
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+
+	pa = coremap_alloc(npages);
+	if (coremap_freecount() < SWAP_LOWATER) {
+		swap_kick();
+	}
+	if (pa == 0 && curthread != NULL && !curthread->t_in_interrupt &&
+	    curthread->t_iplhigh_count == 0) {
+		/*
+		 * Not holding a spinlock, so we can sleep: free what's
+		 * cheap to and try again, rather than fail while there's
+		 * memory sitting in caches.
+		 */
+		swap_reclaim();
+		pa = coremap_alloc(npages);
+	}
+	if (pa == 0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+	coremap_free(KVADDR_TO_PADDR(addr));
+}
+
+bool
+vm_idle(void)
+{
+	return zeropool_fill();
+}
+
+////////////////////////////////////////////////////////////
+//
+// TLB management
+
+/*
+ * When vm_tlbload finds no free slot it has to evict something. The
+ * replacement policy is chosen at build time:
+ *
+ *    options tlbroundrobin   - evict the slots in turn.
+ *    options tlbsecondchance - clock over the slots. The TLB has no
+ *                              reference bits, so a slot counts as
+ *                              referenced when it is loaded. When the
+ *                              hand passes a referenced slot it clears
+ *                              the bit and invalidates the entry but
+ *                              leaves its EntryHi alone; if the page is
+ *                              used again, vm_tlbload finds the slot by
+ *                              probing and revalidates it in place.
+ *    (neither)               - evict at random, with tlbwr.
+ *
+ * The bookkeeping is per-CPU and only touched at splhigh.
+ *
+ * Entries are tagged with the address space's ASID (the EntryHi PID
+ * field), so entries for several processes can sit in the TLB at
+ * once and switching address spaces doesn't need a flush. ASIDs are
+ * handed out in order from a global counter; when they run out, a
+ * new generation starts and every ASID from the old one is stale. An
+ * address space whose ASID is from an old generation gets a new one
+ * the next time it is activated, and each CPU flushes its TLB the
+ * first time it activates anything in a new generation. So the TLB
+ * is only flushed once per CPU per 63 address spaces.
+ *
+ * Since tlb_write and friends load c0_entryhi, which holds the
+ * current PID, anything that writes some other EntryHi value must
+ * put the current one back afterwards.
+ */
+
+#if OPT_TLBROUNDROBIN && OPT_TLBSECONDCHANCE
+#error "Choose at most one of options tlbroundrobin and tlbsecondchance"
+#endif
+
+/* One bit per TLB slot. */
+#define TLBBIT(i) ((uint64_t)1 << (i))
+
+/* ASID 0 is never handed out. */
+#define VM_MAXASID (TLBHI_NPIDS - 1)
+
+#define SET_ENTRYHI(x) __asm volatile("mtc0 %0,$10" :: "r" (x))
+
+struct vm_tlbstate {
+	uint64_t ts_inuse;	/* slots holding a translation */
+	uint64_t ts_ref;	/* second chance: referenced slots */
+	unsigned ts_hand;	/* next slot to consider for eviction */
+	unsigned ts_asid;	/* ASID currently in c0_entryhi */
+	unsigned ts_asidgen;	/* generation of our last flush */
+};
+
+static struct vm_tlbstate vm_tlbstate[MAXCPUS];
+
+/*
+ * Per-CPU state for the UTLB refill handler in exception-mips1.S,
+ * which knows the layout, so don't change it without changing that.
+ *
+ * uc_pt is the page table of the address space active on the CPU, or
+ * NULL. The handler reads the table without as_lock; that's safe
+ * because resident PTEs are only taken away by setting PTE_BUSY (or
+ * clearing the PTE) first and then shooting down the TLB entry, and
+ * the handler runs with interrupts off, so an entry it loads from a
+ * PTE it read just before is gone once the shootdown is done. Pages
+ * loaded there aren't marked referenced in the coremap; instead the
+ * handler sets PTE_ACCESSED, which the page-out daemon checks.
+ *
+ * uc_refills counts the refills the handler has done, which are TLB
+ * faults like any other; vm_utlbtally moves them into vmstats, for
+ * uc_proc, whenever uc_pt changes. uc_lo is where the handler keeps
+ * the LO register while it uses it.
+ *
+ * The handler only runs with random replacement; the other policies
+ * need to see every load, so they always go through vm_fault.
+ */
+struct vm_utlbcpu {
+	struct pagetable *uc_pt;	/* offset 0 */
+	unsigned uc_refills;		/* offset 4 */
+	uint32_t uc_lo;			/* offset 8 */
+	struct proc *uc_proc;		/* not used by the handler */
+};
+
+struct vm_utlbcpu vm_utlbcpu[MAXCPUS];
+
+/*
+ * Count this CPU's fast refills as TLB faults, using random
+ * replacement, of pages that were resident. Call at splhigh, before
+ * changing uc_pt.
+ */
+static
+void
+vm_utlbtally(void)
+{
+	struct vm_utlbcpu *uc;
+	unsigned n;
+
+	/* The UTLB handler finds its CPU's entry by shifting. */
+	KASSERT(sizeof(struct vm_utlbcpu) == 16);
+
+	uc = &vm_utlbcpu[curcpu->c_number];
+	n = uc->uc_refills;
+	if (n == 0) {
+		return;
+	}
+	uc->uc_refills = 0;
+	vmstats_addproc(uc->uc_proc, VMSTAT_TLB_FAULT, n);
+	vmstats_addproc(uc->uc_proc, VMSTAT_TLB_FAULT_REPLACE, n);
+	vmstats_addproc(uc->uc_proc, VMSTAT_TLB_RELOAD, n);
+}
+
+/* ASID allocator */
+static struct spinlock vm_asidlock = SPINLOCK_INITIALIZER;
+static unsigned vm_asidgen = 1;		/* 0 means "no ASID yet" */
+static unsigned vm_nextasid = 1;
+
+/*
+ * EntryHi for VADDR in the address space currently active on this
+ * CPU. Call at splhigh.
+ */
+static
+uint32_t
+vm_tlbhi(vaddr_t vaddr)
+{
+	return (vaddr & TLBHI_VPAGE) |
+		(vm_tlbstate[curcpu->c_number].ts_asid << TLBHI_PIDSHIFT);
+}
+
+/*
+ * Invalidate the whole TLB on this CPU.
+ */
+static
+void
+vm_tlbflush(void)
+{
+	struct vm_tlbstate *ts;
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	ts = &vm_tlbstate[curcpu->c_number];
+	ts->ts_inuse = 0;
+	ts->ts_ref = 0;
+	SET_ENTRYHI(ts->ts_asid << TLBHI_PIDSHIFT);
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+
+	splx(spl);
+}
+
+void
+vm_tlbshootdown_all(void)
+{
+	vm_tlbflush();
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	struct vm_tlbstate *state;
+	int i, spl;
+
+	spl = splhigh();
+	state = &vm_tlbstate[curcpu->c_number];
+
+	i = tlb_probe((ts->ts_vaddr & TLBHI_VPAGE) |
+		      (ts->ts_asid << TLBHI_PIDSHIFT), 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		state->ts_inuse &= ~TLBBIT(i);
+		state->ts_ref &= ~TLBBIT(i);
+	}
+	SET_ENTRYHI(state->ts_asid << TLBHI_PIDSHIFT);
+
+	splx(spl);
+}
+
+/*
+ * Shootdown batches. Each address space keeps a mask of the CPUs that
+ * have activated it since it got its current ASID; only those can
+ * have entries for it, so only those are sent IPIs. The entries on
+ * this CPU are invalidated straight away, and the rest are sent when
+ * the batch is finished, one IPI per CPU however many pages there
+ * are.
+ */
+
+void
+vm_tlbbatch_init(struct tlbbatch *tb)
+{
+	tb->tb_cpus = 0;
+	tb->tb_count = 0;
+}
+
+void
+vm_tlbbatch_add(struct tlbbatch *tb, struct addrspace *as, vaddr_t vaddr)
+{
+	struct tlbshootdown ts;
+	uint32_t cpus;
+
+	KASSERT(spinlock_do_i_hold(&as->as_lock));
+
+	/*
+	 * The caller has already changed the PTE, so a CPU that
+	 * activates AS after we read the mask can't load the old one.
+	 */
+	spinlock_acquire(&vm_asidlock);
+	ts.ts_asid = as->as_asid;
+	cpus = as->as_cpus;
+	spinlock_release(&vm_asidlock);
+	ts.ts_vaddr = vaddr;
+
+	if (ts.ts_asid == 0) {
+		/* Never activated; can't be in any TLB. */
+		return;
+	}
+
+	/*
+	 * Use the ASID even if it's from an old generation: a CPU
+	 * that hasn't flushed since may still be running with it. At
+	 * worst we knock out someone else's entry.
+	 */
+	vm_tlbshootdown(&ts);
+
+	cpus &= ~((uint32_t)1 << curcpu->c_number);
+	if (cpus == 0) {
+		return;
+	}
+	tb->tb_cpus |= cpus;
+	if (tb->tb_count < TLBSHOOTDOWN_MAX) {
+		tb->tb_mappings[tb->tb_count] = ts;
+	}
+	/* Past TLBSHOOTDOWN_MAX, the targets flush everything. */
+	tb->tb_count++;
+}
+
+/*
+ * Kernel pages are loaded as global entries, which match whatever
+ * ASID is used to probe for them, and may be in any CPU's TLB.
+ */
+void
+vm_tlbbatch_addkernel(struct tlbbatch *tb, vaddr_t vaddr)
+{
+	struct tlbshootdown ts;
+	uint32_t cpus;
+	unsigned ncpus;
+	int spl;
+
+	KASSERT(vaddr >= MIPS_KSEG2);
+
+	ncpus = cpu_count();
+	cpus = ncpus >= 32 ? ~(uint32_t)0 : ((uint32_t)1 << ncpus) - 1;
+
+	ts.ts_asid = 0;
+	ts.ts_vaddr = vaddr;
+
+	/* Don't move to another CPU between the shootdown and the mask. */
+	spl = splhigh();
+	vm_tlbshootdown(&ts);
+	cpus &= ~((uint32_t)1 << curcpu->c_number);
+	splx(spl);
+
+	if (cpus == 0) {
+		return;
+	}
+	tb->tb_cpus |= cpus;
+
+	if (tb->tb_count < TLBSHOOTDOWN_MAX) {
+		tb->tb_mappings[tb->tb_count] = ts;
+	}
+	tb->tb_count++;
+}
+
+void
+vm_tlbbatch_finish(struct tlbbatch *tb)
+{
+	unsigned n;
+
+	if (tb->tb_cpus == 0) {
+		return;
+	}
+
+	n = tb->tb_count;
+	if (n > TLBSHOOTDOWN_MAX) {
+		/* Too many; the targets flush everything instead. */
+		n = TLBSHOOTDOWN_MAX + 1;
+	}
+	ipi_tlbshootdown_cpus(tb->tb_cpus, tb->tb_mappings, n);
+	vmstats_inc(VMSTAT_TLB_SHOOTDOWN);
+
+	tb->tb_cpus = 0;
+	tb->tb_count = 0;
+}
+
+/*
+ * Retire AS's ASID. Its entries in any CPU's TLB become unreachable
+ * garbage (until the generation rolls over and they're flushed), and
+ * it gets a fresh ASID, with no entries, when next activated. This
+ * is cheaper than finding the entries, and works for entries on CPUs
+ * the process ran on in the past.
+ */
+void
+vm_tlbinvalidate_as(struct addrspace *as)
+{
+	spinlock_acquire(&vm_asidlock);
+	as->as_asidgen = 0;
+	spinlock_release(&vm_asidlock);
+
+	if (as == curproc_getas()) {
+		as_activate();
+	}
+}
+
+#if OPT_TLBROUNDROBIN || OPT_TLBSECONDCHANCE
+/*
+ * Choose a slot to evict. All slots are in use.
+ */
+static
+int
+vm_tlbvictim(struct vm_tlbstate *ts)
+{
+	int i;
+#if OPT_TLBSECONDCHANCE
+	uint32_t ehi, elo;
+#endif
+
+	for (;;) {
+		i = ts->ts_hand;
+		ts->ts_hand = (ts->ts_hand + 1) % NUM_TLB;
+#if OPT_TLBSECONDCHANCE
+		if (ts->ts_ref & TLBBIT(i)) {
+			ts->ts_ref &= ~TLBBIT(i);
+			tlb_read(&ehi, &elo, i);
+			tlb_write(ehi, elo & ~TLBLO_VALID, i);
+			continue;
+		}
+#endif
+		return i;
+	}
+}
+#endif
+
+/*
+ * Put a translation into the TLB, using a free slot if there is one
+ * and otherwise evicting one according to the replacement policy.
+ *
+ * If PRELOAD is set, this is a fault-around entry rather than the one
+ * that faulted: it is skipped if already present, isn't counted as a
+ * TLB fault, and doesn't count as referenced, so it's the first to
+ * go if it turns out not to be wanted.
+ *
+ * The statistics are charged to PROC as well as to the system, unless
+ * it is NULL.
+ */
+static
+void
+vm_tlbload(vaddr_t vaddr, uint32_t elo, bool preload, struct proc *proc)
+{
+	struct vm_tlbstate *ts;
+	int i, spl;
+
+	KASSERT(NUM_TLB <= 64);
+
+	spl = splhigh();
+	ts = &vm_tlbstate[curcpu->c_number];
+
+	i = NUM_TLB;
+#if OPT_TLBSECONDCHANCE
+	/* Is it sitting in a slot the clock hand invalidated? */
+	i = tlb_probe(vm_tlbhi(vaddr), 0);
+	if (i < 0) {
+		i = NUM_TLB;
+	}
+	else if (preload) {
+		splx(spl);
+		return;
+	}
+#else
+	if (preload && tlb_probe(vm_tlbhi(vaddr), 0) >= 0) {
+		splx(spl);
+		return;
+	}
+#endif
+
+	if (preload) {
+		vmstats_addproc(proc, VMSTAT_TLB_FAULTAROUND, 1);
+	}
+	else {
+		vmstats_addproc(proc, VMSTAT_TLB_FAULT, 1);
+	}
+
+	if (i == NUM_TLB && ts->ts_inuse != ~(uint64_t)0) {
+		for (i=0; i<NUM_TLB; i++) {
+			if ((ts->ts_inuse & TLBBIT(i)) == 0) {
+				break;
+			}
+		}
+	}
+
+	if (i < NUM_TLB) {
+		if (!preload) {
+			vmstats_addproc(proc, VMSTAT_TLB_FAULT_FREE, 1);
+		}
+	}
+	else {
+		if (!preload) {
+			vmstats_addproc(proc, VMSTAT_TLB_FAULT_REPLACE, 1);
+		}
+#if OPT_TLBROUNDROBIN || OPT_TLBSECONDCHANCE
+		i = vm_tlbvictim(ts);
+#else
+		tlb_random(vm_tlbhi(vaddr), elo);
+		splx(spl);
+		return;
+#endif
+	}
+
+	tlb_write(vm_tlbhi(vaddr), elo, i);
+	ts->ts_inuse |= TLBBIT(i);
+	if (!preload) {
+		ts->ts_ref |= TLBBIT(i);
+	}
+	splx(spl);
+}
+
+unsigned vm_faultaround = VM_FAULTAROUND_DEFAULT;
+
+/*
+ * Fault-around: load the TLB with up to vm_faultaround resident pages
+ * of RG near VADDR, nearest first. Pages that aren't resident are
+ * left alone; this is only to save traps, not to read ahead. Call
+ * with as_lock held, before loading the faulting page itself so that
+ * can't be the one that gets evicted.
+ */
+static
+void
+vm_tlbpreload(struct addrspace *as, struct region *rg, vaddr_t vaddr)
+{
+	vaddr_t va, top;
+	pte_t *pte;
+	unsigned dist, loaded, side;
+	uint32_t elo;
+
+	KASSERT(spinlock_do_i_hold(&as->as_lock));
+
+	top = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+	loaded = 0;
+	for (dist = 1; dist <= vm_faultaround; dist++) {
+		for (side = 0; side < 2; side++) {
+			if (loaded >= vm_faultaround) {
+				return;
+			}
+			if (side == 0) {
+				if (top - vaddr <= dist * PAGE_SIZE) {
+					continue;
+				}
+				va = vaddr + dist * PAGE_SIZE;
+			}
+			else {
+				if (vaddr - rg->rg_vbase < dist * PAGE_SIZE) {
+					continue;
+				}
+				va = vaddr - dist * PAGE_SIZE;
+			}
+
+			pte = pt_lookup(as->as_pt, va, false);
+			if (pte == NULL ||
+			    (*pte & (PTE_VALID | PTE_BUSY)) != PTE_VALID) {
+				continue;
+			}
+			elo = (*pte & PTE_FRAME) | TLBLO_VALID;
+			if (*pte & PTE_WRITE) {
+				elo |= TLBLO_DIRTY;
+			}
+			vm_tlbload(va, elo, true, curproc);
+			loaded++;
+		}
+	}
+}
+
+/*
+ * Get a frame holding the contents of the non-resident page VADDR of
+ * region RG, whose PTE is OLDPTE: whatever is in its swap slot, if it
+ * has one, or else its initial contents (from the executable, or
+ * zeros). If PREFETCH is set, nobody has faulted on it yet, so it's
+ * counted as a prefetch instead of a page fault. Called with no locks
+ * held; may sleep.
+ */
+static
+int
+vm_pagein(struct region *rg, vaddr_t vaddr, pte_t oldpte, bool prefetch,
+	  paddr_t *ret)
+{
+	paddr_t pa;
+	int result;
+
+	if ((oldpte & PTE_SWAPPED) == 0 && !region_filepage(rg, vaddr)) {
+		/* Zero-fill; use a page zeroed while idle if there is one. */
+		pa = zeropool_get();
+		if (pa == 0) {
+			pa = swap_getpage();
+			if (pa == 0) {
+				return ENOMEM;
+			}
+			bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+		}
+		vmstats_inc(prefetch ? VMSTAT_PAGE_PREFETCH :
+			    VMSTAT_PAGE_FAULT_ZERO);
+		*ret = pa;
+		return 0;
+	}
+
+	pa = swap_getpage();
+	if (pa == 0) {
+		return ENOMEM;
+	}
+
+	if (oldpte & PTE_SWAPPED) {
+		result = swap_read(PTE_SLOT(oldpte), pa);
+		if (result) {
+			coremap_free(pa);
+			return result;
+		}
+		if (!prefetch) {
+			vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+			vmstats_inc(VMSTAT_SWAP_FILE_READ);
+		}
+	}
+	else {
+		result = region_loadpage(rg, vaddr, pa);
+		if (result) {
+			coremap_free(pa);
+			return result;
+		}
+		if (!prefetch) {
+			vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+			vmstats_inc(VMSTAT_ELF_FILE_READ);
+		}
+	}
+	if (prefetch) {
+		vmstats_inc(VMSTAT_PAGE_PREFETCH);
+	}
+
+	*ret = pa;
+	return 0;
+}
+
+/*
+ * Get the page-cache frame for page VADDR of the shared file mapping
+ * RG, or the segment's frame if RG is shared memory. Sets *HIT if it
+ * was already in memory, which counts as a TLB reload; reading it in
+ * counts as a disk fault, like a page of an executable, a new segment
+ * page as a zero-fill fault, and either as a prefetch if PREFETCH is
+ * set. Called with no locks held; may sleep.
+ */
+static
+int
+vm_sharedpage(struct region *rg, vaddr_t vaddr, bool prefetch,
+	      paddr_t *ret, bool *hit)
+{
+	off_t offset;
+	int result;
+
+	offset = region_fileoffset(rg, vaddr);
+	if (rg->rg_shm != NULL) {
+		result = shm_getpage(rg->rg_shm, offset / PAGE_SIZE, ret, hit);
+		if (result == 0 && !*hit) {
+			vmstats_inc(prefetch ? VMSTAT_PAGE_PREFETCH :
+				    VMSTAT_PAGE_FAULT_ZERO);
+		}
+		return result;
+	}
+
+	result = pagecache_get(rg->rg_vn, offset, ret, hit);
+	if (result) {
+		return result;
+	}
+	if (!*hit) {
+		if (prefetch) {
+			vmstats_inc(VMSTAT_PAGE_PREFETCH);
+		}
+		else {
+			vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+			vmstats_inc(VMSTAT_ELF_FILE_READ);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Point the PTE PTE of the private page VADDR of region RG, which is
+ * not resident, at the frame PA, which now holds its contents, and
+ * release its swap slot if it had one. Call with as_lock held.
+ */
+static
+void
+vm_setprivate(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	      pte_t *pte, paddr_t pa)
+{
+	pte_t oldpte;
+
+	KASSERT(spinlock_do_i_hold(&as->as_lock));
+	KASSERT((*pte & (PTE_VALID | PTE_BUSY)) == 0);
+
+	oldpte = *pte;
+	*pte = pa | PTE_VALID;
+	if (rg->rg_flags & RG_WRITE) {
+		*pte |= PTE_WRITE;
+	}
+	else if (rg->rg_vn != NULL && (oldpte & PTE_SWAPPED) == 0) {
+		/* Can just be dropped, and read again if needed. */
+		*pte |= PTE_FILE;
+	}
+	coremap_setowner(pa, as, vaddr);
+	if (oldpte & PTE_SWAPPED) {
+		swap_free(PTE_SLOT(oldpte));
+	}
+}
+
+/*
+ * Make the non-resident page VADDR of region RG resident: swap it in,
+ * read it, or zero-fill it, and fill in its PTE. WRITE is whether a
+ * shared page should start out dirty; *HIT is set if the page was
+ * already in memory (in the page cache). Call with as_lock held and
+ * the PTE neither valid nor busy; the lock is dropped meanwhile, and
+ * held again on return, even on error. Only the owning thread may
+ * call this, as it relies on nobody else changing the PTE.
+ */
+static
+int
+vm_fill(struct addrspace *as, struct region *rg, vaddr_t vaddr, bool write,
+	bool prefetch, bool *hit)
+{
+	pte_t *pte, oldpte;
+	paddr_t pa;
+	int result;
+
+	KASSERT(spinlock_do_i_hold(&as->as_lock));
+
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	KASSERT(pte != NULL && (*pte & (PTE_VALID | PTE_BUSY)) == 0);
+	oldpte = *pte;
+
+	spinlock_release(&as->as_lock);
+	if (rg->rg_flags & RG_SHARED) {
+		/*
+		 * Shared page. Page-cache frames that are paged out just
+		 * have their PTEs cleared, so this is always zero.
+		 */
+		KASSERT(oldpte == 0);
+		result = vm_sharedpage(rg, vaddr, prefetch, &pa, hit);
+	}
+	else {
+		result = vm_pagein(rg, vaddr, oldpte, prefetch, &pa);
+		*hit = false;
+	}
+	spinlock_acquire(&as->as_lock);
+	if (result) {
+		return result;
+	}
+
+	/* Only we change non-resident PTEs, so it's as we left it. */
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	KASSERT(pte != NULL && *pte == oldpte);
+
+	if (rg->rg_flags & RG_SHARED) {
+		*pte = pa | PTE_VALID | PTE_SHARED;
+		if (write) {
+			*pte |= PTE_WRITE;
+		}
+		return 0;
+	}
+
+	vm_setprivate(as, rg, vaddr, pte, pa);
+	return 0;
+}
+
+/*
+ * Page VADDR of region RG has just been read back from swap slot
+ * SLOT. The page-out daemon writes neighbouring pages out together,
+ * to consecutive slots, so if the pages on either side are in the
+ * slots on either side, they were probably in the same cluster: read
+ * them in too, one request each way. Errors are left for whoever
+ * faults on them. Called by the owner with no locks held.
+ */
+static
+void
+vm_readaround(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	      unsigned slot)
+{
+	paddr_t pas[SWAP_CLUSTER - 1];
+	vaddr_t va, first;
+	pte_t *pte;
+	unsigned n, i, firstslot;
+	int dir, result;
+
+	for (dir = -1; dir <= 1; dir += 2) {
+		/* How far does the run go? */
+		spinlock_acquire(&as->as_lock);
+		for (n=0; n<SWAP_CLUSTER-1; n++) {
+			if (dir < 0 && slot < n + 1) {
+				break;
+			}
+			va = vaddr + dir * (int)(n + 1) * PAGE_SIZE;
+			if (va < rg->rg_vbase ||
+			    va >= rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+				break;
+			}
+			pte = pt_lookup(as->as_pt, va, false);
+			if (pte == NULL || *pte !=
+			    (PTE_MKSLOT(slot + dir * (int)(n + 1)) |
+			     PTE_SWAPPED)) {
+				break;
+			}
+		}
+		spinlock_release(&as->as_lock);
+
+		/* Don't push out pages someone is using for a guess. */
+		for (i=0; i<n; i++) {
+			if (coremap_freecount() < SWAP_LOWATER) {
+				break;
+			}
+			pas[i] = swap_getpage();
+			if (pas[i] == 0) {
+				break;
+			}
+		}
+		n = i;
+		if (n == 0) {
+			continue;
+		}
+
+		/* The N pages next to VADDR, in order, as on disk. */
+		first = dir < 0 ? vaddr - n * PAGE_SIZE : vaddr + PAGE_SIZE;
+		firstslot = dir < 0 ? slot - n : slot + 1;
+		result = swap_readrun(firstslot, pas, n);
+		if (result) {
+			for (i=0; i<n; i++) {
+				coremap_free(pas[i]);
+			}
+			continue;
+		}
+
+		spinlock_acquire(&as->as_lock);
+		for (i=0; i<n; i++) {
+			/* Only we change non-resident PTEs. */
+			pte = pt_lookup(as->as_pt, first + i * PAGE_SIZE,
+					false);
+			KASSERT(pte != NULL &&
+				*pte == (PTE_MKSLOT(firstslot + i) |
+					 PTE_SWAPPED));
+			vm_setprivate(as, rg, first + i * PAGE_SIZE, pte,
+				      pas[i]);
+			vmstats_inc(VMSTAT_PAGE_PREFETCH);
+		}
+		spinlock_release(&as->as_lock);
+	}
+}
+
+int
+vm_prefetch(struct addrspace *as, struct region *rg, vaddr_t vaddr)
+{
+	pte_t *pte;
+	bool hit;
+	int result;
+
+	KASSERT(vaddr >= rg->rg_vbase &&
+		vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE);
+
+	if (coremap_freecount() < SWAP_LOWATER) {
+		/* Don't push out pages someone is using for a guess. */
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&as->as_lock);
+	pte = pt_lookup(as->as_pt, vaddr, true);
+	if (pte == NULL) {
+		spinlock_release(&as->as_lock);
+		return ENOMEM;
+	}
+	if ((*pte & (PTE_VALID | PTE_BUSY)) ||
+	    ((rg->rg_flags & RG_SHARED) == 0 &&
+	     (*pte & PTE_SWAPPED) == 0 && !region_filepage(rg, vaddr))) {
+		/* Already there, on its way out, or just zeros. */
+		spinlock_release(&as->as_lock);
+		return 0;
+	}
+	result = vm_fill(as, rg, vaddr, false, true, &hit);
+	spinlock_release(&as->as_lock);
+	return result;
+}
+
+/*
+ * MADV_SEQUENTIAL: the pages from VM_READAHEAD to 2*VM_READAHEAD
+ * behind VADDR probably won't be wanted again, so mark them
+ * unreferenced; the page-out clock will take them first. Call with
+ * as_lock held.
+ */
+static
+void
+vm_dropbehind(struct addrspace *as, struct region *rg, vaddr_t vaddr)
+{
+	vaddr_t va;
+	pte_t *pte;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&as->as_lock));
+
+	for (i = VM_READAHEAD; i < 2 * VM_READAHEAD; i++) {
+		if (vaddr - rg->rg_vbase < (i + 1) * PAGE_SIZE) {
+			break;
+		}
+		va = vaddr - (i + 1) * PAGE_SIZE;
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte != NULL && (*pte & PTE_VALID) &&
+		    (*pte & PTE_SHARED) == 0) {
+			*pte &= ~PTE_ACCESSED;
+			coremap_clearref(*pte & PTE_FRAME);
+		}
+	}
+}
+
+/*
+ * Get a private copy of the shared resident page OLDPTE. Called with
+ * no locks held; may sleep.
+ */
+static
+int
+vm_cowcopy(pte_t oldpte, paddr_t *ret)
+{
+	paddr_t pa;
+
+	pa = swap_getpage();
+	if (pa == 0) {
+		return ENOMEM;
+	}
+	memmove((void *)PADDR_TO_KVADDR(pa),
+		(const void *)PADDR_TO_KVADDR(oldpte & PTE_FRAME),
+		PAGE_SIZE);
+	*ret = pa;
+	return 0;
+}
+
+/*
+ * A kernel miss on a vmalloc page. The entry is global, so it stays
+ * good whichever address space is active. This can happen wherever
+ * the kernel uses vmalloc'd memory, including with spinlocks held, so
+ * it takes no locks itself; the mapping can't change under us while
+ * the memory is in use. The frame is already there, so it counts as a
+ * TLB reload, and it is the kernel's, so it isn't charged to whatever
+ * process happens to be current.
+ */
+static
+int
+vm_kfault(int faulttype, vaddr_t faultaddress)
+{
+	paddr_t pa;
+
+	if (faulttype == VM_FAULT_READONLY) {
+		/* Always mapped writable; shouldn't happen. */
+		return EFAULT;
+	}
+	pa = vmalloc_lookup(faultaddress);
+	if (pa == 0) {
+		/* A guard page, or a bad pointer. */
+		return EFAULT;
+	}
+	vm_tlbload(faultaddress,
+		   pa | TLBLO_DIRTY | TLBLO_VALID | TLBLO_GLOBAL, false, NULL);
+	vmstats_addproc(NULL, VMSTAT_TLB_RELOAD, 1);
+	return 0;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct region *rg;
+	struct tlbbatch tb;
+	pte_t *pte, oldpte;
+	paddr_t pa, freepa;
+	uint32_t elo;
+	bool writable, reload, filled, swapped;
+	int i, spl, result;
+	unsigned n, slot;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (faultaddress >= MIPS_KSEG2) {
+		return vm_kfault(faulttype, faultaddress);
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = curproc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	rg = as_findregion(as, faultaddress);
+	if (rg == NULL) {
+		return EFAULT;
+	}
+	writable = (rg->rg_flags & RG_WRITE) != 0;
+	if (faulttype != VM_FAULT_READ && !writable) {
+		return EFAULT;
+	}
+	if ((rg->rg_flags & (RG_READ | RG_WRITE | RG_EXEC)) == 0) {
+		/* PROT_NONE */
+		return EFAULT;
+	}
+
+	reload = true;
+	filled = swapped = false;
+	slot = 0;
+	freepa = 0;
+	vm_tlbbatch_init(&tb);
+
+	spinlock_acquire(&as->as_lock);
+ again:
+	pte = pt_lookup(as->as_pt, faultaddress, true);
+	if (pte == NULL) {
+		spinlock_release(&as->as_lock);
+		return ENOMEM;
+	}
+	if (*pte & PTE_BUSY) {
+		swap_waitbusy(as);
+		goto again;
+	}
+
+	if ((*pte & PTE_VALID) == 0) {
+		if (faulttype == VM_FAULT_READONLY) {
+			/* Paged out since the fault; try again. */
+			spinlock_release(&as->as_lock);
+			return 0;
+		}
+
+		/* Not resident: swap it in, or read or zero-fill it. */
+		swapped = (*pte & PTE_SWAPPED) != 0;
+		slot = PTE_SLOT(*pte);
+		result = vm_fill(as, rg, faultaddress,
+				 faulttype != VM_FAULT_READ, false, &reload);
+		if (result) {
+			spinlock_release(&as->as_lock);
+			return result;
+		}
+		pte = pt_lookup(as->as_pt, faultaddress, false);
+		filled = true;
+	}
+	else if (faulttype != VM_FAULT_READ && (*pte & PTE_WRITE) == 0 &&
+		 (*pte & PTE_SHARED)) {
+		/* First write to a shared page: it's dirty now. */
+		KASSERT(writable);
+		*pte |= PTE_WRITE;
+	}
+	else if (faulttype != VM_FAULT_READ && (*pte & PTE_WRITE) == 0 &&
+		 writable) {
+		/*
+		 * Copy-on-write. (For a write miss, don't bother loading
+		 * it read-only first.) If nobody else has the frame any
+		 * more, just take it back.
+		 */
+		oldpte = *pte;
+		if (coremap_refcount(oldpte & PTE_FRAME) == 1) {
+			*pte |= PTE_WRITE;
+			coremap_setowner(oldpte & PTE_FRAME, as, faultaddress);
+		}
+		else {
+			spinlock_release(&as->as_lock);
+			result = vm_cowcopy(oldpte, &pa);
+			if (result) {
+				return result;
+			}
+			spinlock_acquire(&as->as_lock);
+
+			pte = pt_lookup(as->as_pt, faultaddress, false);
+			if (*pte != oldpte) {
+				/* Paged out meanwhile; start over. */
+				spinlock_release(&as->as_lock);
+				coremap_free(pa);
+				spinlock_acquire(&as->as_lock);
+				goto again;
+			}
+			*pte = pa | PTE_VALID | PTE_WRITE;
+			coremap_setowner(pa, as, faultaddress);
+			freepa = oldpte & PTE_FRAME;
+			/*
+			 * CPUs we ran on before may still have the old
+			 * frame loaded. (This knocks out our own entry
+			 * too, so the write faults once more to load the
+			 * new one.)
+			 */
+			vm_tlbbatch_add(&tb, as, faultaddress);
+		}
+	}
+
+	elo = (*pte & PTE_FRAME) | TLBLO_VALID;
+	if (*pte & PTE_WRITE) {
+		elo |= TLBLO_DIRTY;
+	}
+	*pte |= PTE_ACCESSED;
+	coremap_markref(*pte & PTE_FRAME);
+	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", faultaddress, elo & TLBLO_PPAGE);
+
+	if (faulttype == VM_FAULT_READONLY) {
+		/*
+		 * Not a TLB miss: there's a read-only entry for the
+		 * page. Update it in place.
+		 */
+		spl = splhigh();
+		i = tlb_probe(vm_tlbhi(faultaddress), 0);
+		if (i >= 0) {
+			tlb_write(vm_tlbhi(faultaddress), elo, i);
+		}
+		/* else it got flushed meanwhile; it'll just fault again */
+		splx(spl);
+	}
+	else {
+		if (reload) {
+			vmstats_inc(VMSTAT_TLB_RELOAD);
+		}
+		if (rg->rg_advice != MADV_RANDOM) {
+			vm_tlbpreload(as, rg, faultaddress);
+		}
+		vm_tlbload(faultaddress, elo, false, curproc);
+	}
+	if (filled && rg->rg_advice == MADV_SEQUENTIAL) {
+		vm_dropbehind(as, rg, faultaddress);
+	}
+
+	/* Must be under the lock, so page-out can't miss the entry. */
+	spinlock_release(&as->as_lock);
+
+	vm_tlbbatch_finish(&tb);
+	if (freepa != 0) {
+		coremap_free(freepa);
+	}
+
+	if (swapped && rg->rg_advice != MADV_RANDOM) {
+		vm_readaround(as, rg, faultaddress, slot);
+	}
+	if (filled && rg->rg_advice == MADV_SEQUENTIAL) {
+		/* Read ahead; errors are for whoever faults on them. */
+		for (n = 1; n <= VM_READAHEAD; n++) {
+			if (faultaddress - rg->rg_vbase >=
+			    (rg->rg_npages - n) * PAGE_SIZE) {
+				break;
+			}
+			if (vm_prefetch(as, rg, faultaddress + n * PAGE_SIZE)) {
+				break;
+			}
+		}
+	}
+	return 0;
+}
+
+void
+as_activate(void)
+{
+	struct addrspace *as;
+
+	struct vm_tlbstate *ts;
+	bool flush;
+	int spl;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		/*
+		 * Kernel threads don't have an address spaces to
+		 * activate. They only use kseg0, so leave whatever
+		 * user entries are in the TLB alone; they'll be wanted
+		 * again when we switch back. But there's nothing for the
+		 * refill handler to find for them.
+		 */
+		spl = splhigh();
+		vm_utlbtally();
+		vm_utlbcpu[curcpu->c_number].uc_pt = NULL;
+		vm_utlbcpu[curcpu->c_number].uc_proc = NULL;
+		splx(spl);
+		return;
+	}
+
+	spl = splhigh();
+	ts = &vm_tlbstate[curcpu->c_number];
+
+	spinlock_acquire(&vm_asidlock);
+	if (as->as_asidgen != vm_asidgen) {
+		if (vm_nextasid > VM_MAXASID) {
+			/* Out of ASIDs; start a new generation. */
+			vm_asidgen++;
+			if (vm_asidgen == 0) {
+				vm_asidgen = 1;
+			}
+			vm_nextasid = 1;
+		}
+		as->as_asid = vm_nextasid++;
+		as->as_asidgen = vm_asidgen;
+		/* Nobody has entries with the new ASID yet. */
+		as->as_cpus = 0;
+	}
+	as->as_cpus |= (uint32_t)1 << curcpu->c_number;
+	flush = (ts->ts_asidgen != vm_asidgen);
+	ts->ts_asidgen = vm_asidgen;
+	ts->ts_asid = as->as_asid;
+	spinlock_release(&vm_asidlock);
+
+	vm_utlbtally();
+	vm_utlbcpu[curcpu->c_number].uc_pt = as->as_pt;
+	vm_utlbcpu[curcpu->c_number].uc_proc = curproc;
+
+	if (flush) {
+		/* Also loads the new ASID. */
+		vm_tlbflush();
+	}
+	else {
+		SET_ENTRYHI(ts->ts_asid << TLBHI_PIDSHIFT);
+	}
+
+	splx(spl);
+}
+
+void
+as_deactivate(void)
+{
+	int spl;
+
+	/* The address space is about to go away. */
+	spl = splhigh();
+	vm_utlbtally();
+	vm_utlbcpu[curcpu->c_number].uc_pt = NULL;
+	vm_utlbcpu[curcpu->c_number].uc_proc = NULL;
+	splx(spl);
+}
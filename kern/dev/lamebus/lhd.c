@@ -195,6 +195,11 @@ lhd_reset(struct lhd_softc *lh)
 
 /*
  * I/O function (for both reads and writes)
+ *
+ * The device only transfers one sector at a time, but we keep it for
+ * the whole request, so a multi-sector transfer (such as a cluster of
+ * pages going out to swap) runs through consecutive sectors without
+ * other threads' I/O getting in between and costing a seek.
  */
 static
 int
@@ -225,12 +230,12 @@ lhd_io(struct device *d, struct uio *uio)
 		statval |= LHD_ISWRITE;
 	}
 
+	/* Wait until nobody else is using the device. */
+	P(lh->lh_clear);
+
 	/* Loop over all the sectors we were asked to do. */
 	for (i=0; i<len; i++) {
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
 		/*
 		 * Are we writing? If so, transfer the data to the
 		 * on-card buffer.
@@ -263,15 +268,16 @@ lhd_io(struct device *d, struct uio *uio)
 			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
 		}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
 		/* If we failed, return the error. */
 		if (result) {
+			V(lh->lh_clear);
 			return result;
 		}
 	}
 
+	/* Tell another thread it's cleared to go ahead. */
+	V(lh->lh_clear);
+
 	return 0;
 }
 
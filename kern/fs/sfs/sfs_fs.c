@@ -41,8 +41,12 @@
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <vm.h>
+#include <kmemcache.h>
 #include <sfs.h>
 
+struct kmem_cache *sfs_vnode_cache;
+
 /* Shortcuts for the size macros in kern/sfs.h */
 #define SFS_FS_BITMAPSIZE(sfs)  SFS_BITMAPSIZE((sfs)->sfs_super.sp_nblocks)
 #define SFS_FS_BITBLOCKS(sfs)   SFS_BITBLOCKS((sfs)->sfs_super.sp_nblocks)
@@ -282,6 +286,17 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return ENXIO;
 	}
 
+	/* The first mount makes the vnode cache, under the biglock. */
+	if (sfs_vnode_cache == NULL) {
+		sfs_vnode_cache = kmem_cache_create("sfs_vnode",
+						    sizeof(struct sfs_vnode),
+						    NULL, NULL);
+		if (sfs_vnode_cache == NULL) {
+			vfs_biglock_release();
+			return ENOMEM;
+		}
+	}
+
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
@@ -36,17 +36,20 @@
 
 
 #include <vm.h>
+#include <spinlock.h>
+#include "opt-dumbvm.h"
 
 struct vnode;
+struct shmseg;
 
 
 /* 
  * Address space - data structure associated with the virtual memory
  * space of a process.
- *
- * You write this.
  */
 
+#if OPT_DUMBVM
+
 struct addrspace {
   vaddr_t as_vbase1;
   paddr_t as_pbase1;
@@ -57,6 +60,193 @@ struct addrspace {
   paddr_t as_stackpbase;
 };
 
+#else
+
+/*
+ * A region is a page-aligned range of the address space with uniform
+ * permissions. Nothing is allocated for the pages of a region until
+ * they are touched; vm_fault then fills them in. Addresses that
+ * aren't in any region are invalid.
+ *
+ * A region may be backed by part of a file (an executable's segment):
+ * the RG_FILESIZE bytes at file offset RG_OFFSET appear at address
+ * RG_FILEBASE, which need not be page-aligned, and the rest of the
+ * region is zeros. Otherwise, pages start out zero-filled.
+ *
+ * Regions made by mmap are RG_MMAP, and can be unmapped again. A
+ * MAP_SHARED file mapping is RG_SHARED: its pages are the file's
+ * frames in the page cache rather than private copies, and PTE_WRITE
+ * doubles as the dirty bit, since it is only set on a write fault.
+ * Read-only program text is RG_SHARED too, so every process running
+ * the same executable uses the same frames. So is an attached shared
+ * memory segment (shm.h), or an anonymous MAP_SHARED mapping, which
+ * gets a segment of its own: the pages are the segment's frames, the
+ * file fields give the position in the segment instead, and there is
+ * nothing to write back.
+ */
+struct region {
+	vaddr_t rg_vbase;		/* first address */
+	size_t rg_npages;		/* length in pages */
+	int rg_flags;			/* RG_* */
+	struct vnode *rg_vn;		/* backing file, or NULL */
+	off_t rg_offset;		/* file offset of rg_filebase */
+	vaddr_t rg_filebase;		/* where file data starts */
+	size_t rg_filesize;		/* amount of file data */
+	int rg_advice;			/* MADV_NORMAL/RANDOM/SEQUENTIAL */
+	struct shmseg *rg_shm;		/* shared memory segment, or NULL */
+	struct region *rg_next;		/* next region, by address */
+};
+
+#define RG_READ     0x1
+#define RG_WRITE    0x2
+#define RG_EXEC     0x4
+#define RG_SHARED   0x8		/* pages come from the page cache */
+#define RG_MMAP     0x10	/* made by mmap */
+
+struct pagetable;
+struct proc;
+
+/*
+ * as_proc is the process that has (or last had) the address space,
+ * so work the page-out daemon does for it can be charged to it. It
+ * is set by curproc_setas. An address space is always destroyed
+ * before its process, so the pointer stays good as long as the
+ * address space does.
+ *
+ * as_lock protects the page table. The owning process's thread
+ * changes PTEs under it, and so does the page-out daemon, which only
+ * touches resident pages. Since only the owner changes non-resident
+ * PTEs, the owner may drop the lock while it fills in a page.
+ */
+struct addrspace {
+	struct region *as_regions;	/* regions, sorted by address */
+	struct spinlock as_lock;	/* protects the page table */
+	struct pagetable *as_pt;	/* page table */
+	unsigned as_asid;		/* TLB tag; see as_activate */
+	unsigned as_asidgen;		/* generation as_asid belongs to */
+	uint32_t as_cpus;		/* CPUs that have used as_asid */
+	struct region *as_heap;		/* sbrk region, or NULL */
+	vaddr_t as_heapend;		/* current break */
+	struct addrspace *as_next;	/* list of all address spaces */
+	struct proc *as_proc;		/* process using it, or NULL */
+};
+
+/*
+ * The stack region is this big. Since pages are only allocated when
+ * touched, this is the most the stack can grow to, not what it costs.
+ */
+#define VM_STACKPAGES 1024
+
+/*
+ * as_findregion - return the region containing VADDR, or NULL.
+ *
+ * as_define_fileregion - like as_define_region, but the region's
+ *                contents come from FILESIZE bytes of VN at OFFSET
+ *                (and zeros after that), read in as pages are
+ *                touched. Holds a reference to VN. Read-only
+ *                segments are shared through the page cache where
+ *                possible.
+ *
+ * region_filepage - true if the initial contents of page VADDR of
+ *                region RG include file data (otherwise it starts
+ *                out all zeros).
+ *
+ * region_fileoffset - the file (or segment) offset that page VADDR of
+ *                a shared region RG maps. Page-aligned, since shared
+ *                regions line up with the file's pages.
+ *
+ * region_loadpage - fill the frame at PADDR with the initial contents
+ *                of the page VADDR of region RG. May sleep.
+ *
+ * as_unmap     - throw away the pages in the NPAGES pages at VADDR
+ *                (which must be page-aligned), giving back their
+ *                frames and swap slots. The region isn't changed, so
+ *                touching them again gets fresh pages.
+ *
+ * as_mmap      - map LEN bytes of VN at OFFSET (or zeros, if VN is
+ *                NULL) with mmap's PROT and FLAGS, at VADDR if
+ *                MAP_FIXED or else wherever there's room, and hand
+ *                back the address. Holds a reference to VN. Shared
+ *                zeros are a shared memory segment of their own.
+ *
+ * as_munmap    - remove mmap'd pages in [VADDR, VADDR+LEN), writing
+ *                back dirty shared pages first.
+ *
+ * as_msync     - write back dirty shared pages in [VADDR, VADDR+LEN).
+ *
+ * as_sbrk      - move the break (the end of the heap, which starts
+ *                right after the executable's segments) by AMOUNT
+ *                bytes, and hand back the old break. The heap region
+ *                covers the break rounded up to a page; its pages are
+ *                zero-filled on demand, so growing it costs nothing
+ *                until they are touched.
+ *
+ * as_madvise   - apply madvise's ADVICE to [VADDR, VADDR+LEN).
+ *                MADV_RANDOM turns off fault-around, MADV_SEQUENTIAL
+ *                turns on read-ahead and drop-behind, and MADV_NORMAL
+ *                goes back to the default; regions are split so the
+ *                advice covers just the range, except the heap, which
+ *                stays one region and gets it as a whole.
+ *                MADV_WILLNEED reads in the pages that are on swap or
+ *                in a file now; MADV_DONTNEED throws them away, so
+ *                they are zero-filled or read from the file again if
+ *                touched (dirty shared pages are written back first).
+ *
+ * as_mincore   - for each of NPAGES pages from VADDR, set the byte in
+ *                VEC to 1 if it's resident and 0 if not. Fails with
+ *                ENOMEM if any of them isn't mapped.
+ *
+ * as_resident  - number of pages of AS currently in memory. Doesn't
+ *                sleep.
+ *
+ * as_findowner - find the address space that has the frame PADDR
+ *                mapped privately at VADDR, or NULL. For the page-out
+ *                daemon, when the coremap has forgotten a frame's
+ *                owner (see coremap_pickvictim); the frame must be
+ *                pinned, which keeps the answer from going away.
+ *                Doesn't sleep.
+ *
+ * as_dropshared - unmap the page-cache frame PADDR from every address
+ *                space that has it mapped, dropping their references
+ *                to it; mappings used since the clock last came by
+ *                (PTE_ACCESSED) are kept, and their bits cleared.
+ *                Returns true if any of them had written to it,
+ *                so it needs writing back. For the page-out daemon;
+ *                call with no locks held.
+ *
+ * as_shmat     - map the NPAGES pages of shared memory segment SEG at
+ *                VADDR, or wherever there's room if VADDR is 0, and
+ *                hand back the address. Read-only if READONLY. Uses
+ *                the caller's reference to SEG.
+ *
+ * as_shmdt     - unmap the segment attached at VADDR.
+ */
+struct region *as_findregion(struct addrspace *as, vaddr_t vaddr);
+int as_define_fileregion(struct addrspace *as, vaddr_t vaddr,
+			 size_t memsize, struct vnode *vn, off_t offset,
+			 size_t filesize, int readable, int writeable,
+			 int executable);
+bool region_filepage(struct region *rg, vaddr_t vaddr);
+off_t region_fileoffset(struct region *rg, vaddr_t vaddr);
+int region_loadpage(struct region *rg, vaddr_t vaddr, paddr_t paddr);
+void as_unmap(struct addrspace *as, vaddr_t vaddr, size_t npages);
+int as_mmap(struct addrspace *as, vaddr_t vaddr, size_t len, int prot,
+	    int flags, struct vnode *vn, off_t offset, vaddr_t *ret);
+int as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+int as_msync(struct addrspace *as, vaddr_t vaddr, size_t len);
+int as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak);
+int as_madvise(struct addrspace *as, vaddr_t vaddr, size_t len, int advice);
+int as_mincore(struct addrspace *as, vaddr_t vaddr, size_t npages,
+	       char *vec);
+unsigned as_resident(struct addrspace *as);
+struct addrspace *as_findowner(paddr_t paddr, vaddr_t vaddr);
+bool as_dropshared(paddr_t paddr);
+int as_shmat(struct addrspace *as, struct shmseg *seg, size_t npages,
+	     vaddr_t vaddr, bool readonly, vaddr_t *ret);
+int as_shmdt(struct addrspace *as, vaddr_t vaddr);
+
+#endif /* OPT_DUMBVM */
+
 /*
  * Functions in addrspace.c:
  *
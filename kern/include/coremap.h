@@ -0,0 +1,111 @@
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Physical memory (frame) allocator.
+ *
+ * The coremap has one entry for every physical page frame between the
+ * end of the memory stolen during early boot and the top of RAM. It
+ * is built by vm_bootstrap; before that, requests fall through to
+ * ram_stealmem, and that memory is never given back.
+ *
+ * Free frames are kept on a binary buddy system, so a single frame
+ * comes off (or goes back on) a free list in time bounded by the
+ * number of buddy orders, and contiguous runs of frames for
+ * multi-page kernel allocations can still be found by splitting and
+ * coalescing blocks. A run of N frames is carved out of a block of
+ * the next power of two; the unused tail goes straight back on the
+ * free lists, so nothing is wasted by rounding.
+ *
+ *    coremap_bootstrap - take over physical memory from ram.c. After
+ *                        this, ram_stealmem must not be called.
+ *
+ *    coremap_alloc     - allocate NPAGES physically contiguous frames.
+ *                        Returns the physical address of the first,
+ *                        or 0 if no run that long is available.
+ *
+ *    coremap_free      - drop a reference to a run previously returned
+ *                        by coremap_alloc; the frames are released when
+ *                        the last reference goes away. Must be given
+ *                        the address of the first frame of the run.
+ *                        Memory that came from ram_stealmem is
+ *                        silently ignored.
+ *
+ *    coremap_share     - add a reference to a run, e.g. when a page is
+ *                        shared copy-on-write. A run starts out with
+ *                        one reference from coremap_alloc.
+ *
+ *    coremap_refcount  - return the number of references to a run.
+ *                        The answer can only go down behind the
+ *                        caller's back if the caller holds one of the
+ *                        references; in particular, 1 means the caller
+ *                        is the sole owner.
+ *
+ *    coremap_printstats - print free/used frame counts.
+ *
+ * Support for paging user memory out:
+ *
+ *    coremap_setowner  - record that the single frame at PADDR holds
+ *                        the user page VADDR of AS, making it a
+ *                        candidate for page-out. Ignored for shared
+ *                        frames. Freeing the frame clears the owner.
+ *
+ *    coremap_setcached - record that the single frame at PADDR belongs
+ *                        to the page cache, making it a candidate for
+ *                        page-out however many mappings it has.
+ *                        Freeing the frame clears this.
+ *
+ *    coremap_markref   - note that the frame was just used.
+ *
+ *    coremap_clearref  - note that the frame isn't likely to be used
+ *                        again soon, so it is the first to go.
+ *
+ *    coremap_pickvictim - choose a user page to page out, by a clock
+ *                        sweep over the frames that skips recently
+ *                        used ones. The frame comes back pinned, and
+ *                        its owner and virtual address are returned
+ *                        through AS and VADDR. AS is NULL for a page
+ *                        that was shared copy-on-write and is now
+ *                        down to one copy, whose owner isn't known;
+ *                        the caller has to find it. *CACHED is set
+ *                        for a page-cache frame, which has no owner
+ *                        and may be mapped any number of times.
+ *                        Returns 0 if there is nothing that can be
+ *                        paged out.
+ *
+ *    coremap_trypin    - pin the frame at PADDR, as if it had been
+ *                        picked, if it holds the user page VADDR of AS
+ *                        and would be a candidate for the clock: not
+ *                        shared, pinned or recently used. Returns
+ *                        true if it was pinned. For gathering the
+ *                        neighbours of a victim into a cluster.
+ *
+ *    coremap_unpin     - release the pin. Until then, dropping the
+ *                        last reference to the frame with coremap_free
+ *                        sleeps; so coremap_free on a user page must
+ *                        not be called with a spinlock held, and an
+ *                        address space can't go away while one of its
+ *                        frames is pinned.
+ *
+ *    coremap_freecount - number of free frames.
+ */
+
+struct addrspace;
+
+void coremap_bootstrap(void);
+paddr_t coremap_alloc(unsigned long npages);
+void coremap_free(paddr_t paddr);
+void coremap_share(paddr_t paddr);
+unsigned coremap_refcount(paddr_t paddr);
+void coremap_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+void coremap_setcached(paddr_t paddr);
+void coremap_markref(paddr_t paddr);
+void coremap_clearref(paddr_t paddr);
+paddr_t coremap_pickvictim(struct addrspace **as, vaddr_t *vaddr,
+			   bool *cached);
+bool coremap_trypin(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+void coremap_unpin(paddr_t paddr);
+unsigned coremap_freecount(void);
+void coremap_printstats(void);
+
+#endif /* _COREMAP_H_ */
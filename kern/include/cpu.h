@@ -82,10 +82,17 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * Each batch of shootdowns sent gets the next c_shootdown_seq
+	 * number; once the cpu has done them, c_shootdown_done is at
+	 * least that. c_shootdown_done is written under the lock but
+	 * read without it by senders waiting for the acknowledgement.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdown_seq;	/* Last shootdown batch sent */
+	volatile unsigned c_shootdown_done; /* Last shootdown batch done */
 	struct spinlock c_ipi_lock;
 };
 
@@ -109,6 +116,11 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Return the number of cpus that have been created.
+ */
+unsigned cpu_count(void);
+
 /*
  * Return a string describing the CPU type.
  */
@@ -152,6 +164,11 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_cpus does the N shootdowns in MAPPINGS on each CPU
+ * in CPUS (a bitmask of CPU numbers, possibly including this one),
+ * sending one IPI per CPU, and waits until they've all been done.
+ * More than TLBSHOOTDOWN_MAX means flush everything. It must be
+ * called with interrupts on and no spinlocks held.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,6 +183,8 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_cpus(uint32_t cpus,
+			   const struct tlbshootdown *mappings, unsigned n);
 
 void interprocessor_interrupt(void);
 
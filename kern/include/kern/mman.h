@@ -0,0 +1,35 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Constants for mmap, munmap, msync, and madvise; shared with libc's
+ * <sys/mman.h>.
+ */
+
+/* Protection (mmap's PROT argument): PROT_NONE or any of the others */
+#define PROT_NONE     0
+#define PROT_READ     1
+#define PROT_WRITE    2
+#define PROT_EXEC     4
+
+/* Flags for mmap: choose one of these... */
+#define MAP_SHARED    0x0001	/* Changes go to the file */
+#define MAP_PRIVATE   0x0002	/* Changes are private */
+/* ...and any of these. */
+#define MAP_FIXED     0x0010	/* Map at exactly ADDR */
+#define MAP_ANON      0x1000	/* Not backed by a file; zero-filled */
+#define MAP_ANONYMOUS MAP_ANON
+
+/* Flags for msync */
+#define MS_ASYNC      0x1	/* Start writing back (we always finish) */
+#define MS_SYNC       0x2	/* Write back before returning */
+#define MS_INVALIDATE 0x4	/* Discard cached copies (no-op) */
+
+/* Advice for madvise */
+#define MADV_NORMAL     0	/* No particular pattern */
+#define MADV_RANDOM     1	/* Random access; no fault-around */
+#define MADV_SEQUENTIAL 2	/* Sequential; read ahead, drop behind */
+#define MADV_WILLNEED   3	/* Read the pages in now */
+#define MADV_DONTNEED   4	/* Throw the pages away now */
+
+#endif /* _KERN_MMAN_H_ */
@@ -0,0 +1,25 @@
+#ifndef _KERN_SHM_H_
+#define _KERN_SHM_H_
+
+/*
+ * Definitions for System V-style shared memory.
+ */
+
+/* Key for shmget that always makes a new segment */
+#define IPC_PRIVATE  0
+
+/* Flags for shmget (the low bits are mode bits, which are ignored) */
+#define IPC_CREAT    01000	/* make the segment if it doesn't exist */
+#define IPC_EXCL     02000	/* ...and fail if it does */
+
+/* Commands for shmctl */
+#define IPC_RMID     0		/* remove the segment */
+
+/* Flags for shmat */
+#define SHM_RDONLY   010000	/* attach read-only */
+#define SHM_RND      020000	/* round the address down to SHMLBA */
+
+/* Attach addresses must be multiples of this */
+#define SHMLBA       4096
+
+#endif /* _KERN_SHM_H_ */
@@ -59,8 +59,8 @@
 #define SYS_mmap         8
 #define SYS_munmap       9
 #define SYS_mprotect     10
-//#define SYS_madvise    11
-//#define SYS_mincore    12
+#define SYS_madvise      11
+#define SYS_mincore      12
 //#define SYS_mlock      13
 //#define SYS_munlock    14
 //#define SYS_munlockall 15
@@ -196,6 +196,13 @@
 #define SYS_sync         118
 #define SYS_reboot       119
 //#define SYS___sysctl   120
+//                              (virtual memory, continued)
+#define SYS_msync        121
+//                              (System V shared memory)
+#define SYS_shmget       122
+#define SYS_shmat        123
+#define SYS_shmdt        124
+#define SYS_shmctl       125
 
 /*CALLEND*/
 
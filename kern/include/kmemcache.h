@@ -0,0 +1,53 @@
+#ifndef _KMEMCACHE_H_
+#define _KMEMCACHE_H_
+
+/*
+ * Object caches (a slab allocator).
+ *
+ * A kmem_cache hands out objects of one type. They are packed into
+ * pages ("slabs") at their exact size, rather than rounded up to one
+ * of kmalloc's size classes. A cache may have a constructor, which
+ * puts each object into a known state when its slab is made, and a
+ * destructor, which undoes that when the slab is given back. Freed
+ * objects stay constructed, so whatever setup the constructor does is
+ * skipped on the next allocation; in exchange, objects must be handed
+ * back to kmem_cache_free in that same state.
+ *
+ *    kmem_cache_create  - make a cache of objects of SIZE bytes, at most
+ *                         KMEM_MAXSIZE, with constructor CTOR and
+ *                         destructor DTOR, either of which may be
+ *                         NULL. NAME is for statistics and is not
+ *                         copied. Returns NULL if out of memory.
+ *
+ *    kmem_cache_destroy - destroy a cache. Every object must have been
+ *                         freed, and nobody may be reaping at the same
+ *                         time.
+ *
+ *    kmem_cache_alloc   - get a constructed object, or NULL if out of
+ *                         memory.
+ *
+ *    kmem_cache_free    - give one back. Like kfree, this may give a
+ *                         page back to the VM system.
+ *
+ *    kmem_cache_reap    - give back the empty slabs every cache keeps
+ *                         in reserve. May sleep; the VM system calls
+ *                         it when memory is short.
+ *
+ *    kmem_cache_printstats - print statistics for every cache.
+ */
+
+/* Largest object a cache can hold. */
+#define KMEM_MAXSIZE  (PAGE_SIZE / 4)
+
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     void (*ctor)(void *),
+				     void (*dtor)(void *));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+void kmem_cache_reap(void);
+void kmem_cache_printstats(void);
+
+#endif /* _KMEMCACHE_H_ */
@@ -122,10 +122,18 @@ uint32_t random(void);
 /*
  * Kernel heap memory allocation. Like malloc/free.
  * If out of memory, kmalloc returns NULL.
+ *
+ * kheap_reclaim gives back the empty pages kmalloc keeps in reserve.
+ * It may sleep; the VM system calls it when memory is short.
+ *
+ * kmalloc_size returns how much memory kmalloc(SIZE) really uses,
+ * after rounding up to its block size, for callers that keep track.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
+size_t kmalloc_size(size_t size);
 void kheap_printstats(void);
+void kheap_reclaim(void);
 
 /*
  * C string functions. 
@@ -0,0 +1,48 @@
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Page cache for shared file mappings.
+ *
+ * Every MAP_SHARED mapping of a given page of a file uses the same
+ * frame, found here by vnode and offset. The cache holds one coremap
+ * reference to each frame and every mapping another, so a frame is
+ * in use by a process exactly when its refcount is above one. Dirty
+ * data is written back to the file by the mappings themselves (on
+ * msync, munmap, and exit), so a frame nobody maps is clean and can
+ * just be dropped. A frame that is mapped can still be paged out:
+ * the clock picks it like any other, and pagecache_evict unmaps it
+ * everywhere and writes it back if any mapping had written to it.
+ *
+ *    pagecache_bootstrap - set up. Called from vm_bootstrap.
+ *
+ *    pagecache_get       - get the frame for the page of VN at OFFSET
+ *                          (which must be page-aligned), reading it
+ *                          from the file if it isn't cached. Returns
+ *                          it with a reference for the caller, and
+ *                          sets *HIT if no I/O was needed. Bytes past
+ *                          EOF read as zeros. May sleep.
+ *
+ *    pagecache_writeback - write the frame at PADDR back to the page
+ *                          of VN at OFFSET, or as much of it as lies
+ *                          within the file. May sleep.
+ *
+ *    pagecache_reclaim   - drop every cached page nobody maps.
+ *
+ *    pagecache_evict     - page out the cached frame PADDR, which the
+ *                          clock has picked and pinned: unmap it from
+ *                          every address space, write it back if it's
+ *                          dirty, and free it. Unpins it. Returns 0
+ *                          if it was freed, or EAGAIN if it has to
+ *                          stay after all. May sleep.
+ */
+
+struct vnode;
+
+void pagecache_bootstrap(void);
+int pagecache_get(struct vnode *vn, off_t offset, paddr_t *ret, bool *hit);
+int pagecache_writeback(struct vnode *vn, off_t offset, paddr_t paddr);
+void pagecache_reclaim(void);
+int pagecache_evict(paddr_t paddr);
+
+#endif /* _PAGECACHE_H_ */
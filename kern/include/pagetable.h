@@ -0,0 +1,78 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Per-address-space page table.
+ *
+ * This is a two-level table: the top level is an array of 1024
+ * pointers to second-level tables, each of which is one page holding
+ * 1024 page table entries and thus maps 4M of address space. Second-
+ * level tables are only allocated for parts of the address space
+ * that have actually been touched, so a sparse address space costs
+ * little more than the pages it uses.
+ *
+ * A page table entry is a 32-bit word. The hardware-visible bits
+ * line up with the MIPS TLB EntryLo layout (frame number, dirty/write
+ * enable, valid) so that a resident PTE can be turned into a TLB
+ * entry with a mask. The low bits that EntryLo does not use hold
+ * software state. An all-zero PTE means the page has never been
+ * touched. A page that has been paged out has PTE_SWAPPED set and
+ * its swap slot number where the frame number would be.
+ *
+ * The UTLB refill handler in exception-mips1.S walks the table in
+ * assembler, so it knows the geometry and the values of PTE_VALID,
+ * PTE_BUSY and PTE_ACCESSED, and assumes the software bits are the
+ * low eight. It sets PTE_ACCESSED on every page it loads, without
+ * as_lock, so that bit can turn on at any time in a resident PTE;
+ * the page-out daemon clears it (under as_lock) as its clock goes by.
+ *
+ *    pt_create  - allocate an empty page table. Returns NULL if out
+ *                 of memory.
+ *    pt_destroy - free the page table itself. The caller must already
+ *                 have released whatever the PTEs point to.
+ *    pt_lookup  - return a pointer to the PTE for VADDR. If there is
+ *                 no second-level table for it, returns NULL, unless
+ *                 CREATE is set, in which case one is allocated (and
+ *                 NULL means out of memory).
+ *    pt_walk    - call FUNC on every nonzero PTE, in address order.
+ *                 If FUNC returns nonzero the walk stops and that
+ *                 value is returned.
+ */
+
+typedef uint32_t pte_t;
+
+/* Hardware bits (same as TLBLO_*) */
+#define PTE_FRAME     0xfffff000	/* physical frame, if PTE_VALID */
+#define PTE_WRITE     0x00000400	/* writes allowed (TLBLO_DIRTY) */
+#define PTE_VALID     0x00000200	/* page is resident (TLBLO_VALID) */
+
+/* Software bits */
+#define PTE_SWBITS    0x000000ff
+#define PTE_SWAPPED   0x00000001	/* on swap; slot in PTE_FRAME bits */
+#define PTE_BUSY      0x00000002	/* being paged out; wait for it */
+#define PTE_FILE      0x00000004	/* unmodifiable copy of file data */
+#define PTE_SHARED    0x00000008	/* page-cache frame; see pagecache.h */
+#define PTE_ACCESSED  0x00000010	/* loaded into the TLB recently */
+
+/* Swap slot numbers */
+#define PTE_SLOT(pte)     ((pte) >> 12)
+#define PTE_MKSLOT(slot)  ((pte_t)(slot) << 12)
+
+/* Table geometry */
+#define PT_NENTRIES   1024
+#define PT_L1INDEX(va) ((va) >> 22)
+#define PT_L2INDEX(va) (((va) >> 12) & (PT_NENTRIES - 1))
+#define PT_VADDR(l1, l2) (((vaddr_t)(l1) << 22) | ((vaddr_t)(l2) << 12))
+
+struct pagetable {
+	pte_t *pt_l2[PT_NENTRIES];
+};
+
+typedef int (*pt_walkfn)(vaddr_t vaddr, pte_t *pte, void *data);
+
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+int pt_walk(struct pagetable *pt, pt_walkfn func, void *data);
+
+#endif /* _PAGETABLE_H_ */
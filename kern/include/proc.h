@@ -38,6 +38,7 @@
 
 #include <spinlock.h>
 #include <thread.h> /* required for struct threadarray */
+#include <uw-vmstats.h> /* for VMSTAT_COUNT */
 
 struct addrspace;
 struct vnode;
@@ -59,6 +60,10 @@ struct proc {
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
 
+	/* Statistics */
+	unsigned p_vmstats[VMSTAT_COUNT]; /* see uw-vmstats.c */
+	struct proc *p_allnext;		/* next in list of all processes */
+
 #ifdef UW
   /* a vnode to refer to the console device */
   /* this is a quick-and-dirty way to get console writes working */
@@ -94,6 +99,13 @@ int proc_addthread(struct proc *proc, struct thread *t);
 /* Detach a thread from its process. */
 void proc_remthread(struct thread *t);
 
+/*
+ * Call FUNC on every process from proc_create_runprogram (not kproc)
+ * that hasn't been destroyed yet. FUNC may sleep, but mustn't create
+ * or destroy processes.
+ */
+void proc_foreach(void (*func)(struct proc *, void *), void *data);
+
 /* Fetch the address space of the current process. */
 struct addrspace *curproc_getas(void);
 
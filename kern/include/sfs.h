@@ -87,5 +87,8 @@ int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
+/* Where every sfs's vnodes come from; made by the first mount */
+extern struct kmem_cache *sfs_vnode_cache;
+
 
 #endif /* _SFS_H_ */
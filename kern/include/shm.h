@@ -0,0 +1,61 @@
+#ifndef _SHM_H_
+#define _SHM_H_
+
+/*
+ * System V-style shared memory segments.
+ *
+ * A segment is a named piece of anonymous memory that any number of
+ * address spaces can map (shmat) onto the same physical frames, so
+ * processes can pass data without copying it or going near a disk.
+ * Its frames are allocated and zeroed the first time any process
+ * touches each page, and stay until the segment goes away; they are
+ * never paged out. So that segments can't take over memory, all of
+ * them together may hold at most 1/SHM_MEMFRAC of the frames there
+ * were at boot; past that, touching a new page fails with ENOMEM.
+ *
+ * A segment is referenced by its name (until IPC_RMID) and by every
+ * region it is mapped into, and is destroyed when the last reference
+ * goes away.
+ *
+ *    shm_bootstrap - set up. Called from vm_bootstrap.
+ *
+ *    shm_get     - find the segment named KEY, or, with IPC_CREAT in
+ *                  FLAGS, make one of SIZE bytes; IPC_PRIVATE always
+ *                  makes a new one. Hands back its id.
+ *
+ *    shm_create  - make a segment of SIZE bytes with no name, which
+ *                  nothing else can find; for anonymous MAP_SHARED
+ *                  mappings. Hands it back with one reference.
+ *
+ *    shm_lookup  - find segment ID, hand back its size in pages and
+ *                  take a reference to it.
+ *
+ *    shm_incref  - add a reference, e.g. when a mapping is copied.
+ *    shm_decref  - drop a reference. May sleep.
+ *
+ *    shm_getpage - hand back the frame holding page INDEX, with a new
+ *                  reference to it for the caller (a PTE), zeroing a
+ *                  new one if nobody has used the page yet. Sets *HIT
+ *                  if it already existed. Fails with ENOMEM if that
+ *                  would go past the limit. May sleep.
+ *
+ *    shm_remove  - remove the name of segment ID (IPC_RMID), so it is
+ *                  destroyed once it isn't mapped anywhere.
+ */
+
+#define SHM_MAXSEGS   32	/* segments in the system */
+#define SHM_MAXPAGES  1024	/* largest segment */
+#define SHM_MEMFRAC   4		/* segments get at most 1/this of memory */
+
+struct shmseg;
+
+void shm_bootstrap(void);
+int shm_get(int key, size_t size, int flags, int *id);
+int shm_create(size_t size, struct shmseg **ret);
+int shm_lookup(int id, struct shmseg **ret, size_t *npages);
+void shm_incref(struct shmseg *seg);
+void shm_decref(struct shmseg *seg);
+int shm_getpage(struct shmseg *seg, unsigned index, paddr_t *ret, bool *hit);
+int shm_remove(int id);
+
+#endif /* _SHM_H_ */
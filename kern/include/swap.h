@@ -0,0 +1,67 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap: paging user memory out to a raw disk.
+ *
+ * The swap space is the whole of SWAP_DEVICE, divided into page-sized
+ * slots tracked by a bitmap. A page-out daemon thread keeps a reserve
+ * of free frames by picking victims with the coremap's clock and
+ * writing them to swap, so faulting threads normally find a free
+ * frame without waiting for a disk write. If there is no swap disk,
+ * the daemon can still drop clean file pages and page-cache frames,
+ * but private memory can't be overcommitted.
+ *
+ *    swap_bootstrap - open the swap device and start the daemon.
+ *                     Called late in boot, after the devices exist.
+ *
+ *    swap_getpage   - allocate a frame for a user page. If memory is
+ *                     out, calls swap_reclaim, and failing that waits
+ *                     for the daemon to free some. Returns 0 if
+ *                     memory is full and nothing could be paged out.
+ *
+ *    swap_kick      - tell the daemon memory is getting low. Doesn't
+ *                     sleep, so can be called from anywhere.
+ *
+ *    swap_reclaim   - give back memory that's cheap to free right away:
+ *                     pre-zeroed pages, cached file pages nobody maps,
+ *                     empty slabs and kmalloc's empty pages. Doesn't
+ *                     page anything out. May sleep, so call with no
+ *                     spinlocks held.
+ *
+ *    swap_read      - read slot SLOT into the frame at PADDR.
+ *    swap_readrun   - read the N slots starting at SLOT into the frames
+ *                     in PAS, in one request where possible.
+ *    swap_free      - release a slot.
+ *
+ *    swap_waitbusy  - wait for a PTE_BUSY page of AS to settle. Call
+ *                     with as->as_lock held; it is dropped while
+ *                     sleeping and held again on return, and the
+ *                     caller must look up the PTE again.
+ */
+
+#define SWAP_DEVICE   "lhd1raw:"
+
+/*
+ * Pages are paged out in clusters of up to this many neighbouring
+ * pages of one address space, written to consecutive slots in one
+ * request; page faults read the rest of a cluster back the same way.
+ */
+#define SWAP_CLUSTER  8
+
+/* Daemon wakes below LOWATER free frames and works up to HIWATER. */
+#define SWAP_LOWATER  16
+#define SWAP_HIWATER  32
+
+struct addrspace;
+
+void swap_bootstrap(void);
+paddr_t swap_getpage(void);
+void swap_kick(void);
+void swap_reclaim(void);
+int swap_read(unsigned slot, paddr_t paddr);
+int swap_readrun(unsigned slot, const paddr_t *pas, unsigned n);
+void swap_free(unsigned slot);
+void swap_waitbusy(struct addrspace *as);
+
+#endif /* _SWAP_H_ */
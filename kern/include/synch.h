@@ -138,4 +138,10 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Set up the object caches the primitives are allocated from. Called
+ * once, early in boot, before anything creates one.
+ */
+void synch_bootstrap(void);
+
 #endif /* _SYNCH_H_ */
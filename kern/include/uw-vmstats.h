@@ -7,12 +7,13 @@
 
 /* ----------------------------------------------------------------------- */
 /* Virtual memory stats */
-/* Tracks stats on user programs */
+/* Tracks stats on user programs, in total and per process */
 
 /* NOTE !!!!!! WARNING !!!!!
  * All of the functions (except vmstats_print) whose names begin with '_'
  * assume that atomicity is ensured elsewhere
- * (i.e., outside of these routines) by acquiring stats_lock.
+ * (i.e., outside of these routines) by acquiring stats_lock
+ * (for _vmstats_inc, having interrupts off is enough).
  * All of the functions whose names do not begin
  * with '_' ensure atomicity locally (except vmstats_print).
  *
@@ -36,7 +37,17 @@
 #define VMSTAT_ELF_FILE_READ          (7)
 #define VMSTAT_SWAP_FILE_READ         (8)
 #define VMSTAT_SWAP_FILE_WRITE        (9)
-#define VMSTAT_COUNT                 (10)
+#define VMSTAT_ZERO_POOL_HIT         (10)
+#define VMSTAT_ZERO_POOL_MISS        (11)
+#define VMSTAT_TLB_FAULTAROUND       (12)
+#define VMSTAT_TLB_SHOOTDOWN         (13)
+#define VMSTAT_PAGE_PREFETCH         (14)
+#define VMSTAT_ZSWAP_STORE           (15)
+#define VMSTAT_ZSWAP_ZERO            (16)
+#define VMSTAT_ZSWAP_BYTES           (17)
+#define VMSTAT_ZSWAP_HIT             (18)
+#define VMSTAT_ZSWAP_MISS            (19)
+#define VMSTAT_COUNT                 (20)
 
 /* ----------------------------------------------------------------------- */
 
@@ -52,6 +63,20 @@ void _vmstats_init(void);                    /* atomicity must be ensured elsewh
 void vmstats_inc(unsigned int index);    /* uses locking */
 void _vmstats_inc(unsigned int index);   /* atomicity must be ensured elsewhere */
 
+/* Add N to the specified count, for counts of bytes and the like */
+void vmstats_add(unsigned int index, unsigned int n);    /* uses locking */
+void _vmstats_add(unsigned int index, unsigned int n);   /* atomicity must be ensured elsewhere */
+
+/* Same, but charge PROC (if not NULL) rather than the current process,
+ * for work done on a process's behalf by a kernel thread
+ */
+struct proc;
+void vmstats_addproc(struct proc *proc, unsigned int index, unsigned int n); /* uses locking */
+
+/* Current total of one count, over all CPUs, and its name */
+unsigned int vmstats_get(unsigned int index);
+const char *vmstats_name(unsigned int index);
+
 /* Print the statistics: assumes that at least vmstats_init has been called */
 void vmstats_print(void);                    /* Does NOT use locking */
 
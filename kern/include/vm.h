@@ -59,5 +59,68 @@ void free_kpages(vaddr_t addr);
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/* Discard every CPU's TLB entries for an address space */
+struct addrspace;
+void vm_tlbinvalidate_as(struct addrspace *as);
+
+/*
+ * Discard TLB entries for individual pages. After changing or
+ * clearing a resident PTE, with as_lock held, call vm_tlbbatch_add;
+ * that takes care of this CPU at once. Other CPUs that may have the
+ * page loaded are told by vm_tlbbatch_finish, which waits until
+ * they've done it, so must be called with no spinlocks held. The
+ * frame mustn't be reused, or its contents relied on, until then.
+ * Several pages, even of different address spaces, can go in one
+ * batch and cost one IPI per CPU. vm_tlbbatch_addkernel is the same
+ * for a kernel (vmalloc) page, which any CPU may have loaded. (Not
+ * dumbvm.)
+ */
+struct tlbbatch {
+	uint32_t tb_cpus;		/* other CPUs to tell */
+	unsigned tb_count;		/* pages added */
+	struct tlbshootdown tb_mappings[TLBSHOOTDOWN_MAX];
+};
+
+void vm_tlbbatch_init(struct tlbbatch *tb);
+void vm_tlbbatch_add(struct tlbbatch *tb, struct addrspace *as,
+		     vaddr_t vaddr);
+void vm_tlbbatch_addkernel(struct tlbbatch *tb, vaddr_t vaddr);
+void vm_tlbbatch_finish(struct tlbbatch *tb);
+
+/*
+ * Fault-around: on a TLB miss, vm_fault also loads up to this many
+ * neighbouring pages that are already resident, to save the traps.
+ * 0 turns it off; it can be changed from the menu. (Not dumbvm.)
+ * The saving is the drop in "TLB Faults" in the vmstats printed at
+ * shutdown between a run at "fa 0" and one at the default; those
+ * include the refills done by the UTLB handler, which with random
+ * replacement only sends vm_fault the misses on non-resident pages.
+ */
+#define VM_FAULTAROUND_DEFAULT  4
+#define VM_FAULTAROUND_MAX      32
+extern unsigned vm_faultaround;
+
+/*
+ * Read-ahead for MADV_SEQUENTIAL regions: after reading in a page,
+ * vm_fault reads in this many more after it.
+ *
+ * vm_prefetch - make page VADDR of region RG of AS resident, if it's
+ *               on swap or in a file, without loading it into the
+ *               TLB. Only for AS's own thread. Returns ENOMEM rather
+ *               than forcing anything out if memory is short. (Not
+ *               dumbvm.)
+ */
+#define VM_READAHEAD  8
+struct region;
+int vm_prefetch(struct addrspace *as, struct region *rg, vaddr_t vaddr);
+
+/*
+ * Do a little background work while the current cpu is idle. Called
+ * from the idle loop with interrupts off; must not sleep. Returns
+ * true if it did anything, in which case the caller should check for
+ * runnable threads again before idling.
+ */
+bool vm_idle(void);
+
 
 #endif /* _VM_H_ */
@@ -0,0 +1,56 @@
+#ifndef _VMALLOC_H_
+#define _VMALLOC_H_
+
+/*
+ * Kernel virtual allocator.
+ *
+ * kmalloc hands out kseg0 addresses, so anything bigger than a page
+ * needs physically contiguous frames, and once memory has been in use
+ * for a while a run of free frames long enough may not exist even
+ * though plenty of single frames do. vmalloc instead takes one frame
+ * at a time, wherever they are, and maps them at consecutive pages of
+ * a window in kseg2, VMALLOC_BASE to VMALLOC_BASE + VMALLOC_NPAGES
+ * pages. The TLB entries are loaded on demand by vm_fault, as global
+ * entries, so they survive address space switches.
+ *
+ * The price is a TLB entry per page in use, a page of address space
+ * left unmapped after each allocation to catch overruns, and a TLB
+ * shootdown on every CPU when an allocation is freed. So it is for
+ * big tables and buffers that live a while, not for anything small or
+ * short-lived. Nor is it for anything touched before vm_bootstrap, by
+ * the exception handlers, or while the TLB is being changed: kernel
+ * stacks, page tables (the UTLB handler reads those through kseg0),
+ * or the memory backing kmalloc itself.
+ *
+ *    vmalloc   - allocate SIZE bytes, page-aligned and not zeroed.
+ *                Returns NULL if out of frames or address space.
+ *
+ *    vfree     - free a block vmalloc returned; NULL is ignored. Sends
+ *                IPIs and waits for them, so mustn't be called with a
+ *                spinlock held or from an interrupt handler.
+ *
+ *    kvmalloc  - kmalloc for a page or less, vmalloc for more. For
+ *                tables whose size isn't known in advance.
+ *    kvfree    - free a block from kvmalloc.
+ *
+ *    vmalloc_lookup     - the frame mapped at VADDR, or 0 if none.
+ *                         Called by vm_fault; takes no locks.
+ *
+ *    vmalloc_printstats - print usage statistics.
+ */
+
+#include <vm.h>
+
+/* True if VA is in the vmalloc window. */
+#define VMALLOC_ADDR(va) \
+	((vaddr_t)(va) >= VMALLOC_BASE && \
+	 (vaddr_t)(va) < VMALLOC_BASE + VMALLOC_NPAGES * PAGE_SIZE)
+
+void *vmalloc(size_t size);
+void vfree(void *ptr);
+void *kvmalloc(size_t size);
+void kvfree(void *ptr);
+paddr_t vmalloc_lookup(vaddr_t vaddr);
+void vmalloc_printstats(void);
+
+#endif /* _VMALLOC_H_ */
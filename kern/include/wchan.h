@@ -37,6 +37,11 @@
 
 struct wchan; /* Opaque */
 
+/*
+ * Set up the wait channel system. Called once, early in boot.
+ */
+void wchan_bootstrap(void);
+
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
  * NAME should be a string constant; if not, the caller is responsible
@@ -0,0 +1,36 @@
+#ifndef _ZEROPOOL_H_
+#define _ZEROPOOL_H_
+
+/*
+ * Pre-zeroed page pool.
+ *
+ * Each cpu keeps a small stack of free frames that it zeroed in its
+ * idle loop, so zero-fill page faults usually don't have to bzero a
+ * page on the spot. The pool is only topped up while memory is
+ * plentiful, and the page-out daemon empties it when it isn't.
+ *
+ *    zeropool_bootstrap - set up the pools. Called from vm_bootstrap.
+ *
+ *    zeropool_get       - take a zeroed frame from the pool, or return
+ *                         0 if there isn't one. Counts hits and misses
+ *                         in vmstats.
+ *
+ *    zeropool_fill      - zero one more frame for the current cpu's
+ *                         pool. Called from the idle loop; returns
+ *                         false if there was nothing to do.
+ *
+ *    zeropool_drain     - give every pooled frame back to the coremap.
+ */
+
+/* Frames per cpu */
+#define ZPOOL_HIWATER  16
+
+/* Don't fill the pools unless more than this many frames are free */
+#define ZPOOL_MINFREE  (SWAP_HIWATER * 2)
+
+void zeropool_bootstrap(void);
+paddr_t zeropool_get(void);
+bool zeropool_fill(void);
+void zeropool_drain(void);
+
+#endif /* _ZEROPOOL_H_ */
@@ -0,0 +1,47 @@
+#ifndef _ZSWAP_H_
+#define _ZSWAP_H_
+
+/*
+ * Compressed swap cache.
+ *
+ * A memory tier in front of the swap disk. When the page-out daemon
+ * pages something out, it first tries to compress it; if it shrinks
+ * to ZSWAP_MAXLEN bytes or less and the pool has room, the compressed
+ * copy is kept in kmalloc'd memory and nothing is written to disk.
+ * Pages that are all zeros are just recorded as such, with no data.
+ * The page keeps its swap slot either way, so PTEs and the rest of
+ * the VM system don't know where a swapped page really is; swap.c
+ * asks here first on every read, and drops the copy when the slot is
+ * freed.
+ *
+ * The compressor is a small LZ77 variant (see zswap.c). It is fast
+ * and does well on the pages we actually see, which are mostly zeros
+ * or repeat short patterns.
+ *
+ *    zswap_bootstrap - set up for NSLOTS swap slots. Called from
+ *                      swap_bootstrap.
+ *
+ *    zswap_store     - try to keep the page in the frame at PADDR as
+ *                      the contents of slot SLOT. Returns false if it
+ *                      should go to disk instead. Only the page-out
+ *                      daemon calls this.
+ *
+ *    zswap_load      - if slot SLOT is held here, fill the frame at
+ *                      PADDR from it and return true.
+ *
+ *    zswap_drop      - forget slot SLOT, if it is held here. Doesn't
+ *                      sleep.
+ */
+
+/* Pages must compress to this many bytes or less to be kept. */
+#define ZSWAP_MAXLEN  (PAGE_SIZE / 2)
+
+/* The pool may use at most 1/ZSWAP_POOLFRAC of memory. */
+#define ZSWAP_POOLFRAC  4
+
+void zswap_bootstrap(unsigned nslots);
+bool zswap_store(unsigned slot, paddr_t paddr);
+bool zswap_load(unsigned slot, paddr_t paddr);
+void zswap_drop(unsigned slot);
+
+#endif /* _ZSWAP_H_ */
@@ -49,6 +49,8 @@
 #include <vnode.h>
 #include <vfs.h>
 #include <synch.h>
+#include <vm.h>
+#include <kmemcache.h>
 #include <kern/fcntl.h>  
 
 /*
@@ -56,13 +58,18 @@
  */
 struct proc *kproc;
 
+/* Where proc structures come from. */
+static struct kmem_cache *proc_cache;
+
 /*
  * Mechanism for making the kernel menu thread sleep while processes are running
  */
 #ifdef UW
 /* count of the number of processes, excluding kproc */
 static volatile unsigned int proc_count;
-/* provides mutual exclusion for proc_count */
+/* list of the same processes, for proc_foreach */
+static struct proc *proc_all;
+/* provides mutual exclusion for proc_count and proc_all */
 /* it would be better to use a lock here, but we use a semaphore because locks are not implemented in the base kernel */ 
 static struct semaphore *proc_count_mutex;
 /* used to signal the kernel menu thread when there are no processes */
@@ -71,6 +78,29 @@ struct semaphore *no_proc_sem;
 
 
 
+/*
+ * Constructor and destructor for proc_cache.
+ */
+static
+void
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_cleanup(&proc->p_threads);
+	spinlock_cleanup(&proc->p_lock);
+}
+
 /*
  * Create a proc structure.
  */
@@ -80,18 +110,17 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(proc_cache, proc);
 		return NULL;
 	}
 
-	threadarray_init(&proc->p_threads);
-	spinlock_init(&proc->p_lock);
+	/* p_threads and p_lock were set up by proc_ctor. */
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -99,6 +128,9 @@ proc_create(const char *name)
 	/* VFS fields */
 	proc->p_cwd = NULL;
 
+	bzero(proc->p_vmstats, sizeof(proc->p_vmstats));
+	proc->p_allnext = NULL;
+
 #ifdef UW
 	proc->console = NULL;
 #endif // UW
@@ -112,6 +144,10 @@ proc_create(const char *name)
 void
 proc_destroy(struct proc *proc)
 {
+#ifdef UW
+	struct proc **pp;
+#endif // UW
+
 	/*
          * note: some parts of the process structure, such as the address space,
          *  are destroyed in sys_exit, before we get here
@@ -163,11 +199,25 @@ proc_destroy(struct proc *proc)
 	}
 #endif // UW
 
-	threadarray_cleanup(&proc->p_threads);
-	spinlock_cleanup(&proc->p_lock);
+#ifdef UW
+	/* take it off the list while it's still intact */
+	P(proc_count_mutex);
+	for (pp = &proc_all; *pp != proc; pp = &(*pp)->p_allnext) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = proc->p_allnext;
+	V(proc_count_mutex);
+#endif // UW
+
+	/*
+	 * p_threads (with whatever space it has grown) and p_lock are
+	 * kept for the next proc_create; proc_dtor cleans them up.
+	 */
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
+	KASSERT(proc->p_lock.lk_holder == NULL);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(proc_cache, proc);
 
 #ifdef UW
 	/* decrement the process count */
@@ -193,6 +243,12 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+  proc_cache = kmem_cache_create("proc", sizeof(struct proc),
+				 proc_ctor, proc_dtor);
+  if (proc_cache == NULL) {
+    panic("proc_bootstrap: Out of memory\n");
+  }
+
   kproc = proc_create("[kernel]");
   if (kproc == NULL) {
     panic("proc_create for kproc failed\n");
@@ -268,12 +324,32 @@ proc_create_runprogram(const char *name)
            are created using a call to proc_create_runprogram  */
 	P(proc_count_mutex); 
 	proc_count++;
+	proc->p_allnext = proc_all;
+	proc_all = proc;
 	V(proc_count_mutex);
 #endif // UW
 
 	return proc;
 }
 
+void
+proc_foreach(void (*func)(struct proc *, void *), void *data)
+{
+	struct proc *proc;
+
+#ifdef UW
+	P(proc_count_mutex);
+	for (proc = proc_all; proc != NULL; proc = proc->p_allnext) {
+		func(proc, data);
+	}
+	V(proc_count_mutex);
+#else
+	(void)proc;
+	(void)func;
+	(void)data;
+#endif // UW
+}
+
 /*
  * Add a thread to a process. Either the thread or the process might
  * or might not be current.
@@ -362,5 +438,10 @@ curproc_setas(struct addrspace *newas)
 	oldas = proc->p_addrspace;
 	proc->p_addrspace = newas;
 	spinlock_release(&proc->p_lock);
+#if !OPT_DUMBVM
+	if (newas != NULL) {
+		newas->as_proc = proc;
+	}
+#endif
 	return oldas;
 }
@@ -42,6 +42,7 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
@@ -49,7 +50,10 @@
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <uw-vmstats.h>
+#include <swap.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-dumbvm.h"
 
 
 /*
@@ -107,6 +111,8 @@ boot(void)
 
 	/* Early initialization. */
 	ram_bootstrap();
+	wchan_bootstrap();
+	synch_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
 	hardclock_bootstrap();
@@ -129,6 +135,11 @@ boot(void)
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
 
+#if !OPT_DUMBVM
+	/* Swap needs the disks, and threads. */
+	swap_bootstrap();
+#endif
+
 
 	/*
 	 * Make sure various things aren't screwed up.
@@ -153,6 +164,10 @@ shutdown(void)
 
 	thread_shutdown();
 
+#if !OPT_DUMBVM
+	vmstats_print();
+#endif
+
 	splhigh();
 }
 
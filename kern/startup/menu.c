@@ -40,11 +40,18 @@
 #include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
+#include <coremap.h>
+#include <vm.h>
+#include <kmemcache.h>
+#include <vmalloc.h>
+#include <addrspace.h>
+#include <uw-vmstats.h>
 #include <syscall.h>
 #include <test.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-dumbvm.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -406,6 +413,11 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	kmem_cache_printstats();
+	coremap_printstats();
+#if !OPT_DUMBVM
+	vmalloc_printstats();
+#endif
 	
 	return 0;
 }
@@ -439,6 +451,169 @@ showmenu(const char *name, const char *x[])
 	kprintf("\n");
 }
 
+#if !OPT_DUMBVM
+/*
+ * Command to show or set the VM fault-around window.
+ */
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	int n;
+
+	if (nargs > 2) {
+		kprintf("Usage: fa [pages]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		n = atoi(args[1]);
+		if (n < 0 || n > VM_FAULTAROUND_MAX) {
+			kprintf("fa: window must be 0-%d pages\n",
+				VM_FAULTAROUND_MAX);
+			return EINVAL;
+		}
+		vm_faultaround = n;
+	}
+	kprintf("Fault-around window: %u pages\n", vm_faultaround);
+	return 0;
+}
+
+/*
+ * Per-process VM statistics. "vs" prints a table of the processes
+ * running now; "vs N" also starts a thread that prints it every N
+ * seconds while there are processes, so it can be watched while a
+ * program runs from the menu. "vs 0" stops that.
+ */
+
+static struct spinlock vmstat_lock = SPINLOCK_INITIALIZER;
+static int vmstat_interval;		/* seconds; 0 to stop */
+static bool vmstat_running;		/* printing thread exists */
+
+static
+void
+vmstat_row(struct proc *proc, void *data)
+{
+	unsigned stats[VMSTAT_COUNT];
+	unsigned resident;
+	bool *any = data;
+
+	spinlock_acquire(&proc->p_lock);
+	memcpy(stats, proc->p_vmstats, sizeof(stats));
+	/* p_lock keeps the address space from being destroyed. */
+	resident = proc->p_addrspace == NULL ? 0 :
+		as_resident(proc->p_addrspace);
+	spinlock_release(&proc->p_lock);
+
+	if (!*any) {
+		kprintf("%-16s %9s %9s %9s %9s %9s %9s\n", "PROCESS",
+			"TLBFAULTS", "PAGEFLTS", "ELFREADS", "SWAPINS",
+			"SWAPOUTS", "RESIDENT");
+		*any = true;
+	}
+	kprintf("%-16s %9u %9u %9u %9u %9u %9u\n", proc->p_name,
+		stats[VMSTAT_TLB_FAULT],
+		stats[VMSTAT_PAGE_FAULT_ZERO] + stats[VMSTAT_PAGE_FAULT_DISK],
+		stats[VMSTAT_ELF_FILE_READ],
+		stats[VMSTAT_SWAP_FILE_READ],
+		stats[VMSTAT_SWAP_FILE_WRITE],
+		resident);
+}
+
+/*
+ * Print the table. Unless ALWAYS is set, print nothing if there are
+ * no user processes.
+ */
+static
+void
+vmstat_table(bool always)
+{
+	bool any = false;
+
+	proc_foreach(vmstat_row, &any);
+	if (!any && !always) {
+		return;
+	}
+	/* Kernel threads' own work, such as the page cache's, lands here. */
+	vmstat_row(kproc, &any);
+	kprintf("%-16s %9u %9u %9u %9u %9u\n", "(total)",
+		vmstats_get(VMSTAT_TLB_FAULT),
+		vmstats_get(VMSTAT_PAGE_FAULT_ZERO) +
+		vmstats_get(VMSTAT_PAGE_FAULT_DISK),
+		vmstats_get(VMSTAT_ELF_FILE_READ),
+		vmstats_get(VMSTAT_SWAP_FILE_READ),
+		vmstats_get(VMSTAT_SWAP_FILE_WRITE));
+}
+
+static
+void
+vmstat_thread(void *unused1, unsigned long unused2)
+{
+	int interval;
+
+	(void)unused1;
+	(void)unused2;
+
+	for (;;) {
+		spinlock_acquire(&vmstat_lock);
+		interval = vmstat_interval;
+		if (interval == 0) {
+			vmstat_running = false;
+		}
+		spinlock_release(&vmstat_lock);
+		if (interval == 0) {
+			break;
+		}
+
+		clocksleep(interval);
+		vmstat_table(false);
+	}
+}
+
+static
+int
+cmd_vmstat(int nargs, char **args)
+{
+	bool start;
+	int n, result;
+
+	if (nargs > 2) {
+		kprintf("Usage: vs [seconds]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		n = atoi(args[1]);
+		if (n < 0) {
+			kprintf("vs: interval must not be negative\n");
+			return EINVAL;
+		}
+
+		spinlock_acquire(&vmstat_lock);
+		vmstat_interval = n;
+		start = (n > 0 && !vmstat_running);
+		if (start) {
+			vmstat_running = true;
+		}
+		spinlock_release(&vmstat_lock);
+
+		if (start) {
+			result = thread_fork("vmstat", NULL, vmstat_thread,
+					     NULL, 0);
+			if (result) {
+				spinlock_acquire(&vmstat_lock);
+				vmstat_running = false;
+				spinlock_release(&vmstat_lock);
+				kprintf("vs: thread_fork failed: %s\n",
+					strerror(result));
+				return result;
+			}
+		}
+	}
+
+	vmstat_table(true);
+	return 0;
+}
+#endif
+
 static const char *opsmenu[] = {
 	"[s]       Shell                     ",
 	"[p]       Other program             ",
@@ -452,6 +627,10 @@ static const char *opsmenu[] = {
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
 	"[dth]	   Enable debugging of type DB THREADS",
+#if !OPT_DUMBVM
+	"[fa]      Show/set fault-around window",
+	"[vs]      Per-process VM stats [secs]",
+#endif
 	NULL
 };
 
@@ -471,6 +650,10 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km3] kmalloc scaling test          ",
+#if !OPT_DUMBVM
+	"[km4] vmalloc fragmentation test    ",
+#endif
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -563,6 +746,10 @@ static struct {
 	{ "panic",	cmd_panic },
 	{ "q",		cmd_quit },
 	{ "dth",	cmd_enableDebuggingThreadFlags },
+#if !OPT_DUMBVM
+	{ "fa",		cmd_faultaround },
+	{ "vs",		cmd_vmstat },
+#endif
 	{ "exit",	cmd_quit },
 	{ "halt",	cmd_quit },
 
@@ -583,6 +770,10 @@ static struct {
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km3",	mallocscale },
+#if !OPT_DUMBVM
+	{ "km4",	vmalloctest },
+#endif
 #if OPT_NET
 	{ "net",	nettest },
 #endif
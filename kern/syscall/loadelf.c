@@ -45,6 +45,10 @@
  * If you wanted to support memory-mapped executables you would need
  * to rearrange this to map each segment.
  *
+ * Without dumbvm, that is what happens: each segment is recorded with
+ * as_define_fileregion, and vm_fault reads its pages in from the file
+ * as they are touched, so nothing is loaded here.
+ *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
  * linker). And you'd have to write a dynamic linker...
@@ -60,6 +64,10 @@
 #include <vnode.h>
 #include <elf.h>
 
+#include "opt-dumbvm.h"
+
+#if OPT_DUMBVM
+
 /*
  * Load a segment at virtual address VADDR. The segment in memory
  * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
@@ -144,6 +152,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 	
 	return result;
 }
+#endif /* OPT_DUMBVM */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -243,11 +252,24 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_DUMBVM
 		result = as_define_region(as,
 					  ph.p_vaddr, ph.p_memsz,
 					  ph.p_flags & PF_R,
 					  ph.p_flags & PF_W,
 					  ph.p_flags & PF_X);
+#else
+		if (ph.p_filesz > ph.p_memsz) {
+			kprintf("ELF: warning: segment filesize > segment memsize\n");
+			return ENOEXEC;
+		}
+		result = as_define_fileregion(as,
+					      ph.p_vaddr, ph.p_memsz,
+					      v, ph.p_offset, ph.p_filesz,
+					      ph.p_flags & PF_R,
+					      ph.p_flags & PF_W,
+					      ph.p_flags & PF_X);
+#endif
 		if (result) {
 			return result;
 		}
@@ -258,6 +280,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return result;
 	}
 
+#if OPT_DUMBVM
 	/*
 	 * Now actually load each segment.
 	 */
@@ -295,6 +318,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return result;
 		}
 	}
+#endif
 
 	result = as_complete_load(as);
 	if (result) {
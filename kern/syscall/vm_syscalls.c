@@ -0,0 +1,228 @@
+/*
+ * Memory-management system calls for the demand-paged VM system.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/shm.h>
+#include <kern/unistd.h>
+#include <lib.h>
+#include <copyinout.h>
+#include <proc.h>
+#include <current.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <shm.h>
+#include <syscall.h>
+
+/*
+ * sbrk: move the end of the heap by AMOUNT bytes and return where it
+ * used to be. Pages are only allocated when they're touched, so this
+ * just adjusts the heap region.
+ */
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+	struct addrspace *as;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+	return as_sbrk(as, amount, retval);
+}
+
+/*
+ * mmap. There's no per-process file table yet, just the console, so
+ * the only descriptors there are to map are 0-2, and the console
+ * can't be mapped; in practice only MAP_ANON works from userlevel.
+ * The VM side (as_mmap) handles files in general.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, vaddr_t *retval)
+{
+	struct addrspace *as;
+	struct vnode *vn;
+	int result;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+
+	vn = NULL;
+	if ((flags & MAP_ANON) == 0) {
+		if (fd != STDIN_FILENO && fd != STDOUT_FILENO &&
+		    fd != STDERR_FILENO) {
+			return EBADF;
+		}
+		vn = curproc->console;
+		result = VOP_MMAP(vn);
+		if (result) {
+			return result;
+		}
+	}
+
+	return as_mmap(as, (vaddr_t)addr, len, prot, flags, vn, offset,
+		       retval);
+}
+
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	struct addrspace *as;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+	return as_munmap(as, (vaddr_t)addr, len);
+}
+
+/*
+ * msync. Writing back is always synchronous, so MS_ASYNC is the same
+ * as MS_SYNC; and there are no other copies to invalidate.
+ */
+int
+sys_msync(userptr_t addr, size_t len, int flags)
+{
+	struct addrspace *as;
+
+	if ((flags & (MS_SYNC | MS_ASYNC)) == (MS_SYNC | MS_ASYNC) ||
+	    (flags & ~(MS_SYNC | MS_ASYNC | MS_INVALIDATE)) != 0) {
+		return EINVAL;
+	}
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+	return as_msync(as, (vaddr_t)addr, len);
+}
+
+int
+sys_madvise(userptr_t addr, size_t len, int advice)
+{
+	struct addrspace *as;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+	return as_madvise(as, (vaddr_t)addr, len, advice);
+}
+
+/*
+ * mincore: one byte per page of the range, 1 if it's resident. The
+ * answer is gathered a chunk at a time so the kernel buffer stays
+ * small.
+ */
+#define MINCORE_CHUNK 64
+
+int
+sys_mincore(userptr_t addr, size_t len, userptr_t vec)
+{
+	struct addrspace *as;
+	char buf[MINCORE_CHUNK];
+	vaddr_t vaddr;
+	size_t npages, n;
+	int result;
+
+	vaddr = (vaddr_t)addr;
+	if ((vaddr & PAGE_FRAME) != vaddr || len > USERSPACETOP - vaddr) {
+		return EINVAL;
+	}
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+
+	while (npages > 0) {
+		n = npages < MINCORE_CHUNK ? npages : MINCORE_CHUNK;
+		result = as_mincore(as, vaddr, n, buf);
+		if (result) {
+			return result;
+		}
+		result = copyout(buf, vec, n);
+		if (result) {
+			return result;
+		}
+		vaddr += n * PAGE_SIZE;
+		vec = (userptr_t)((char *)vec + n);
+		npages -= n;
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// System V shared memory
+
+int
+sys_shmget(int key, size_t size, int flags, int *retval)
+{
+	return shm_get(key, size, flags, retval);
+}
+
+int
+sys_shmat(int shmid, userptr_t addr, int flags, vaddr_t *retval)
+{
+	struct addrspace *as;
+	struct shmseg *seg;
+	vaddr_t vaddr;
+	size_t npages;
+	int result;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+
+	vaddr = (vaddr_t)addr;
+	if (flags & SHM_RND) {
+		vaddr -= vaddr % SHMLBA;
+	}
+
+	result = shm_lookup(shmid, &seg, &npages);
+	if (result) {
+		return result;
+	}
+	result = as_shmat(as, seg, npages, vaddr, (flags & SHM_RDONLY) != 0,
+			  retval);
+	if (result) {
+		shm_decref(seg);
+		return result;
+	}
+	return 0;
+}
+
+int
+sys_shmdt(userptr_t addr)
+{
+	struct addrspace *as;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+	return as_shmdt(as, (vaddr_t)addr);
+}
+
+/*
+ * shmctl. Only IPC_RMID is supported; there is no struct shmid_ds, so
+ * BUF is ignored.
+ */
+int
+sys_shmctl(int shmid, int cmd, userptr_t buf)
+{
+	(void)buf;
+
+	if (cmd != IPC_RMID) {
+		return EINVAL;
+	}
+	return shm_remove(shmid);
+}
@@ -32,6 +32,8 @@
  */
 #include <types.h>
 #include <lib.h>
+#include <clock.h>
+#include <cpu.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
@@ -44,7 +46,7 @@
  * available memory.
  *
  * mallocstress does the same thing, but from NTHREADS different
- * threads at once.
+ * threads at once. See below for mallocscale.
  */
 
 #define NTRIES   1200
@@ -137,3 +139,120 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * mallocscale runs a load like mallocstress's, first in one thread and
+ * then in one thread per cpu, and times both. Each thread does the
+ * same work, so if kmalloc scales the second run takes no longer than
+ * the first. It sticks to subpage sizes, which is the part that can
+ * scale, keeps a few blocks at a time, and checks nobody else wrote
+ * on them.
+ */
+
+#define SCALE_TRIES  4000
+#define SCALE_LIVE   8
+#define SCALE_MAXSZ  2000
+
+static
+void
+scalethread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	unsigned char *live[SCALE_LIVE];
+	size_t livesz[SCALE_LIVE];
+	unsigned char mark;
+	unsigned i, slot;
+	size_t sz, j;
+
+	for (i=0; i<SCALE_LIVE; i++) {
+		live[i] = NULL;
+	}
+
+	for (i=0; i<SCALE_TRIES; i++) {
+		slot = i % SCALE_LIVE;
+		mark = num * SCALE_LIVE + slot;
+		if (live[slot] != NULL) {
+			if (live[slot][0] != mark ||
+			    live[slot][livesz[slot]-1] != mark) {
+				kprintf("thread %lu: block %p was overwritten; "
+					"test failed.\n", num, live[slot]);
+			}
+			kfree(live[slot]);
+		}
+
+		sz = (i * 37 + num * 101) % SCALE_MAXSZ + 1;
+		live[slot] = kmalloc(sz);
+		if (live[slot] == NULL) {
+			kprintf("thread %lu: kmalloc returned NULL\n", num);
+			break;
+		}
+		for (j=0; j<sz; j++) {
+			live[slot][j] = mark;
+		}
+		livesz[slot] = sz;
+	}
+
+	for (i=0; i<SCALE_LIVE; i++) {
+		kfree(live[i]);
+	}
+	V(sem);
+}
+
+static
+void
+mallocscale_run(struct semaphore *sem, unsigned nthreads)
+{
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	unsigned i;
+	int result;
+
+	gettime(&secs1, &nsecs1);
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("mallocscale", NULL,
+				     scalethread, sem, i);
+		if (result) {
+			panic("mallocscale: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(sem);
+	}
+
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+
+	kprintf("%u thread%s: %lu.%09lu seconds\n", nthreads,
+		nthreads == 1 ? "" : "s",
+		(unsigned long) secs, (unsigned long) nsecs);
+}
+
+int
+mallocscale(int nargs, char **args)
+{
+	struct semaphore *sem;
+	unsigned ncpus;
+
+	(void)nargs;
+	(void)args;
+
+	sem = sem_create("mallocscale", 0);
+	if (sem == NULL) {
+		panic("mallocscale: sem_create failed\n");
+	}
+
+	ncpus = cpu_count();
+	kprintf("Starting kmalloc scaling test on %u cpus...\n", ncpus);
+
+	mallocscale_run(sem, 1);
+	if (ncpus > 1) {
+		mallocscale_run(sem, ncpus);
+	}
+
+	sem_destroy(sem);
+	kprintf("kmalloc scaling test done\n");
+
+	return 0;
+}
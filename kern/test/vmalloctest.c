@@ -0,0 +1,130 @@
+/*
+ * Test code for vmalloc.
+ *
+ * Fragments physical memory on purpose: takes every free frame, then
+ * gives back the even-numbered ones, so no two free frames are next
+ * to each other. Then it finds the largest block kmalloc can get and
+ * the largest vmalloc can get, and checks that every page of the
+ * latter really is separate memory. kmalloc should manage one page at
+ * most; vmalloc should manage about as many pages as are free.
+ *
+ * While the frames are held nothing else can get memory, so this is
+ * best run from an otherwise idle menu.
+ */
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <coremap.h>
+#include <vmalloc.h>
+#include <test.h>
+
+/*
+ * Largest number of pages, less than LIMIT, that ALLOC can get in
+ * one block. Each try is freed straight away.
+ */
+static
+unsigned
+vmt_largest(void *(*alloc)(size_t), void (*release)(void *),
+	    unsigned limit)
+{
+	unsigned good, bad, mid;
+	void *ptr;
+
+	good = 0;
+	bad = limit;
+	while (bad - good > 1) {
+		mid = good + (bad - good) / 2;
+		ptr = alloc(mid * PAGE_SIZE);
+		if (ptr == NULL) {
+			bad = mid;
+		}
+		else {
+			release(ptr);
+			good = mid;
+		}
+	}
+	return good;
+}
+
+int
+vmalloctest(int nargs, char **args)
+{
+	paddr_t pa, held, kept;
+	unsigned nheld, nfree, kpages, vpages, i, limit;
+	uint32_t *block;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting vmalloc test...\n");
+
+	/* Take everything, chained through the frames themselves. */
+	held = 0;
+	nheld = 0;
+	while ((pa = coremap_alloc(1)) != 0) {
+		*(paddr_t *)PADDR_TO_KVADDR(pa) = held;
+		held = pa;
+		nheld++;
+	}
+
+	/* Give back the even-numbered ones. */
+	kept = 0;
+	while (held != 0) {
+		pa = held;
+		held = *(paddr_t *)PADDR_TO_KVADDR(pa);
+		if ((pa / PAGE_SIZE) % 2 == 0) {
+			coremap_free(pa);
+		}
+		else {
+			*(paddr_t *)PADDR_TO_KVADDR(pa) = kept;
+			kept = pa;
+		}
+	}
+
+	nfree = coremap_freecount();
+	kprintf("Took %u frames and gave back the even ones; %u free\n",
+		nheld, nfree);
+
+	limit = nfree + 1;
+	if (limit > VMALLOC_NPAGES) {
+		limit = VMALLOC_NPAGES;
+	}
+	kpages = vmt_largest(kmalloc, kfree, limit);
+	vpages = vmt_largest(vmalloc, vfree, limit);
+	kprintf("Largest block from kmalloc: %u pages\n", kpages);
+	kprintf("Largest block from vmalloc: %u pages\n", vpages);
+
+	if (vpages <= kpages) {
+		kprintf("vmalloc did no better than kmalloc; "
+			"test failed\n");
+	}
+
+	/* Write a different number on every word, then read them back. */
+	block = vpages > 0 ? vmalloc(vpages * PAGE_SIZE) : NULL;
+	if (vpages > 0 && block == NULL) {
+		kprintf("vmalloc of %u pages failed the second time; "
+			"test failed\n", vpages);
+	}
+	else if (block != NULL) {
+		for (i=0; i<vpages * PAGE_SIZE / sizeof(*block); i++) {
+			block[i] = i;
+		}
+		for (i=0; i<vpages * PAGE_SIZE / sizeof(*block); i++) {
+			if (block[i] != i) {
+				kprintf("Word %u of the vmalloc'd block is "
+					"0x%x; test failed\n", i, block[i]);
+				break;
+			}
+		}
+		vfree(block);
+	}
+
+	while (kept != 0) {
+		pa = kept;
+		kept = *(paddr_t *)PADDR_TO_KVADDR(pa);
+		coremap_free(pa);
+	}
+
+	kprintf("vmalloc test done\n");
+	return 0;
+}
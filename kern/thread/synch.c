@@ -38,8 +38,49 @@
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
+#include <vm.h>
+#include <kmemcache.h>
 #include <synch.h>
 
+static struct kmem_cache *sem_cache;
+static struct kmem_cache *lock_cache;
+static struct kmem_cache *cv_cache;
+
+////////////////////////////////////////////////////////////
+//
+// Setup.
+
+static
+void
+sem_ctor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	spinlock_init(&sem->sem_lock);
+}
+
+static
+void
+sem_dtor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	spinlock_cleanup(&sem->sem_lock);
+}
+
+void
+synch_bootstrap(void)
+{
+	sem_cache = kmem_cache_create("semaphore", sizeof(struct semaphore),
+				      sem_ctor, sem_dtor);
+	lock_cache = kmem_cache_create("lock", sizeof(struct lock),
+				       NULL, NULL);
+	cv_cache = kmem_cache_create("cv", sizeof(struct cv), NULL, NULL);
+	if (sem_cache == NULL || lock_cache == NULL || cv_cache == NULL) {
+		panic("synch_bootstrap: Out of memory\n");
+	}
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Semaphore.
@@ -51,25 +92,25 @@ sem_create(const char *name, int initial_count)
 
         KASSERT(initial_count >= 0);
 
-        sem = kmalloc(sizeof(struct semaphore));
+        sem = kmem_cache_alloc(sem_cache);
         if (sem == NULL) {
                 return NULL;
         }
 
         sem->sem_name = kstrdup(name);
         if (sem->sem_name == NULL) {
-                kfree(sem);
+                kmem_cache_free(sem_cache, sem);
                 return NULL;
         }
 
 	sem->sem_wchan = wchan_create(sem->sem_name);
 	if (sem->sem_wchan == NULL) {
 		kfree(sem->sem_name);
-		kfree(sem);
+		kmem_cache_free(sem_cache, sem);
 		return NULL;
 	}
 
-	spinlock_init(&sem->sem_lock);
+	/* sem_lock was set up by sem_ctor. */
         sem->sem_count = initial_count;
 
         return sem;
@@ -79,12 +120,13 @@ void
 sem_destroy(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
+	/* The cache keeps sem_lock for the next sem_create. */
+	KASSERT(sem->sem_lock.lk_holder == NULL);
 
 	/* wchan_cleanup will assert if anyone's waiting on it */
-	spinlock_cleanup(&sem->sem_lock);
 	wchan_destroy(sem->sem_wchan);
         kfree(sem->sem_name);
-        kfree(sem);
+        kmem_cache_free(sem_cache, sem);
 }
 
 void 
@@ -152,14 +194,14 @@ lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = kmem_cache_alloc(lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
+                kmem_cache_free(lock_cache, lock);
                 return NULL;
         }
         
@@ -176,7 +218,7 @@ lock_destroy(struct lock *lock)
         // add stuff here as needed
         
         kfree(lock->lk_name);
-        kfree(lock);
+        kmem_cache_free(lock_cache, lock);
 }
 
 void
@@ -215,14 +257,14 @@ cv_create(const char *name)
 {
         struct cv *cv;
 
-        cv = kmalloc(sizeof(struct cv));
+        cv = kmem_cache_alloc(cv_cache);
         if (cv == NULL) {
                 return NULL;
         }
 
         cv->cv_name = kstrdup(name);
         if (cv->cv_name==NULL) {
-                kfree(cv);
+                kmem_cache_free(cv_cache, cv);
                 return NULL;
         }
         
@@ -239,7 +281,7 @@ cv_destroy(struct cv *cv)
         // add stuff here as needed
         
         kfree(cv->cv_name);
-        kfree(cv);
+        kmem_cache_free(cv_cache, cv);
 }
 
 void
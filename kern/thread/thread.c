@@ -46,8 +46,11 @@
 #include <threadprivate.h>
 #include <proc.h>
 #include <current.h>
+#include <platform/maxcpus.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <vm.h>
+#include <kmemcache.h>
 #include <mainbus.h>
 #include <vnode.h>
 
@@ -64,6 +67,10 @@ struct wchan {
 	struct spinlock wc_lock;	/* lock for mutual exclusion */
 };
 
+/* Where threads and wait channels come from. */
+static struct kmem_cache *thread_cache;
+static struct kmem_cache *wchan_cache;
+
 /* Master array of CPUs. */
 DECLARRAY(cpu);
 DEFARRAY(cpu, /*no inline*/ );
@@ -111,6 +118,31 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Constructor and destructor for thread_cache: the parts of a thread
+ * that are the same for every new thread, and are put back that way
+ * by the time it is destroyed.
+ */
+static
+void
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	thread_machdep_init(&thread->t_machdep);
+	threadlistnode_init(&thread->t_listnode, thread);
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_machdep_cleanup(&thread->t_machdep);
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -123,22 +155,20 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
-	/* Thread subsystem fields */
-	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
+	/* Thread subsystem fields (t_machdep, t_listnode: thread_ctor) */
 	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
@@ -187,6 +217,8 @@ cpu_create(unsigned hardware_number)
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_seq = 0;
+	c->c_shootdown_done = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -227,6 +259,15 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Return the number of cpus.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
 /*
  * Destroy a thread.
  *
@@ -252,14 +293,13 @@ thread_destroy(struct thread *thread)
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
 	}
-	threadlistnode_cleanup(&thread->t_listnode);
-	thread_machdep_cleanup(&thread->t_machdep);
+	/* t_listnode and t_machdep are left for thread_dtor. */
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
 }
 
 /*
@@ -351,6 +391,12 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread),
+					 thread_ctor, thread_dtor);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -613,8 +659,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	cur->t_state = newstate;
 
 	/*
-	 * Get the next thread. While there isn't one, call md_idle().
-	 * curcpu->c_isidle must be true when md_idle is
+	 * Get the next thread. While there isn't one, give the VM system
+	 * a chance to do background work, and call md_idle() if it has
+	 * nothing to do. curcpu->c_isidle must be true when md_idle is
 	 * called. Unlock the runqueue while idling too, to make sure
 	 * things can be added to it.
 	 *
@@ -635,7 +682,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!vm_idle()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -963,6 +1012,43 @@ thread_consider_migration(void)
  * Wait channel functions
  */
 
+/*
+ * Constructor and destructor for wchan_cache.
+ */
+static
+void
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_init(&wc->wc_lock);
+	threadlist_init(&wc->wc_threads);
+}
+
+static
+void
+wchan_dtor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_cleanup(&wc->wc_lock);
+	threadlist_cleanup(&wc->wc_threads);
+}
+
+/*
+ * Set up wchan_cache. Called early in boot, before anything makes a
+ * wait channel.
+ */
+void
+wchan_bootstrap(void)
+{
+	wchan_cache = kmem_cache_create("wchan", sizeof(struct wchan),
+					wchan_ctor, wchan_dtor);
+	if (wchan_cache == NULL) {
+		panic("wchan_bootstrap: Out of memory\n");
+	}
+}
+
 /*
  * Create a wait channel. NAME is a symbolic string name for it.
  * This is what's displayed by ps -alx in Unix.
@@ -976,26 +1062,26 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmem_cache_alloc(wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	spinlock_init(&wc->wc_lock);
-	threadlist_init(&wc->wc_threads);
+	/* wc_lock and wc_threads were set up by wchan_ctor. */
 	wc->wc_name = name;
 	return wc;
 }
 
 /*
- * Destroy a wait channel. Must be empty and unlocked.
- * (The corresponding cleanup functions require this.)
+ * Destroy a wait channel. Must be empty and unlocked; it goes back
+ * to wchan_cache that way, and wchan_dtor checks it.
  */
 void
 wchan_destroy(struct wchan *wc)
 {
-	spinlock_cleanup(&wc->wc_lock);
-	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	/* Nobody may be holding it, since it goes back to the cache. */
+	KASSERT(wc->wc_lock.lk_holder == NULL);
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	kmem_cache_free(wchan_cache, wc);
 }
 
 /*
@@ -1140,26 +1226,103 @@ ipi_broadcast(int code)
 	}
 }
 
-void
-ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+/*
+ * Queue N shootdowns for TARGET and send it one IPI for all of them.
+ * If that's more than it has room for, it flushes its whole TLB
+ * instead. Returns a ticket for ipi_tlbshootdown_wait.
+ */
+static
+unsigned
+ipi_tlbshootdown_many(struct cpu *target,
+		      const struct tlbshootdown *mappings, unsigned n)
 {
-	int n;
+	unsigned i, ticket;
+	int num;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
+	num = target->c_numshootdown;
+	if (num == TLBSHOOTDOWN_ALL || num + n > TLBSHOOTDOWN_MAX) {
 		target->c_numshootdown = TLBSHOOTDOWN_ALL;
 	}
 	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+		for (i=0; i<n; i++) {
+			target->c_shootdown[num + i] = mappings[i];
+		}
+		target->c_numshootdown = num + n;
 	}
+	ticket = ++target->c_shootdown_seq;
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
 
 	spinlock_release(&target->c_ipi_lock);
+
+	return ticket;
+}
+
+/*
+ * Wait until TARGET has done the shootdowns that got TICKET. This
+ * polls c_shootdown_done rather than taking the IPI lock, which the
+ * target needs to make progress. Interrupts must be on, so we can
+ * answer shootdowns sent to us meanwhile; otherwise two CPUs
+ * shooting each other down would wait forever.
+ */
+static
+void
+ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket)
+{
+	KASSERT(curthread->t_iplhigh_count == 0);
+
+	while ((int)(target->c_shootdown_done - ticket) < 0) {
+		/* spin */
+	}
+}
+
+void
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+{
+	ipi_tlbshootdown_many(target, mapping, 1);
+}
+
+void
+ipi_tlbshootdown_cpus(uint32_t cpus, const struct tlbshootdown *mappings,
+		      unsigned n)
+{
+	unsigned tickets[MAXCPUS];
+	unsigned i, j, num;
+	struct cpu *c;
+
+	KASSERT(MAXCPUS <= 32);
+
+	/* Send them all first, so the targets work in parallel. */
+	num = cpuarray_num(&allcpus);
+	for (i=0; i<num; i++) {
+		if ((cpus & ((uint32_t)1 << i)) == 0) {
+			continue;
+		}
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			if (n > TLBSHOOTDOWN_MAX) {
+				vm_tlbshootdown_all();
+			}
+			else {
+				for (j=0; j<n; j++) {
+					vm_tlbshootdown(&mappings[j]);
+				}
+			}
+			cpus &= ~((uint32_t)1 << i);
+			continue;
+		}
+		tickets[i] = ipi_tlbshootdown_many(c, mappings, n);
+	}
+
+	for (i=0; i<num; i++) {
+		if (cpus & ((uint32_t)1 << i)) {
+			ipi_tlbshootdown_wait(cpuarray_get(&allcpus, i),
+					      tickets[i]);
+		}
+	}
 }
 
 void
@@ -1202,6 +1365,7 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_done = curcpu->c_shootdown_seq;
 	}
 
 	curcpu->c_ipi_pending = 0;
@@ -0,0 +1,1250 @@
+/*
+ * Address spaces for the demand-paged VM system.
+ *
+ * An address space is a sorted list of regions plus a page table.
+ * Defining a region (or the stack) only records the range; physical
+ * pages are allocated one at a time by vm_fault when first touched,
+ * so a program only pays for the memory it actually uses; likewise,
+ * an executable's segments are read in a page at a time. as_copy
+ * shares the resident pages copy-on-write instead of copying them.
+ * The heap is a region like any other, except that sbrk changes its
+ * length, which may be zero. mmap regions (and shared memory
+ * segments) go as high as they fit, below the stack, to leave the
+ * heap room to grow.
+ *
+ * Pages may be paged out behind our back; see swap.c for the rules.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <uio.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <shm.h>
+
+/*
+ * Every address space, for as_findowner. as_listlock comes before
+ * as_lock.
+ */
+static struct addrspace *as_list;
+static struct spinlock as_listlock = SPINLOCK_INITIALIZER;
+
+struct addrspace *
+as_create(void)
+{
+	struct addrspace *as;
+
+	as = kmalloc(sizeof(struct addrspace));
+	if (as == NULL) {
+		return NULL;
+	}
+
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	as->as_regions = NULL;
+	spinlock_init(&as->as_lock);
+	as->as_asid = 0;
+	as->as_asidgen = 0;
+	as->as_cpus = 0;
+	as->as_heap = NULL;
+	as->as_heapend = 0;
+	as->as_proc = NULL;
+
+	spinlock_acquire(&as_listlock);
+	as->as_next = as_list;
+	as_list = as;
+	spinlock_release(&as_listlock);
+
+	return as;
+}
+
+off_t
+region_fileoffset(struct region *rg, vaddr_t vaddr)
+{
+	/*
+	 * RG_FILEBASE needn't be page-aligned, and then the first page
+	 * starts below it; so count from the start of its page.
+	 */
+	return rg->rg_offset - (off_t)(rg->rg_filebase % PAGE_SIZE) +
+		(off_t)(vaddr - (rg->rg_filebase & PAGE_FRAME));
+}
+
+/*
+ * A region holds a reference to its file or segment; these take
+ * another one for a copy of the region and drop one.
+ */
+static
+void
+region_hold(struct region *rg)
+{
+	if (rg->rg_vn != NULL) {
+		VOP_INCREF(rg->rg_vn);
+	}
+	if (rg->rg_shm != NULL) {
+		shm_incref(rg->rg_shm);
+	}
+}
+
+static
+void
+region_drop(struct region *rg)
+{
+	if (rg->rg_vn != NULL) {
+		VOP_DECREF(rg->rg_vn);
+	}
+	if (rg->rg_shm != NULL) {
+		shm_decref(rg->rg_shm);
+	}
+}
+
+/*
+ * Give back the frame or swap slot of page VADDR, whose PTE (now
+ * cleared) was OLD. A shared page that was written to is written back
+ * to its file first. Call with no locks held; may sleep.
+ */
+static
+void
+as_releasepage(struct addrspace *as, vaddr_t vaddr, pte_t old)
+{
+	struct region *rg;
+	int result;
+
+	if (old & PTE_VALID) {
+		rg = NULL;
+		if ((old & PTE_SHARED) && (old & PTE_WRITE)) {
+			rg = as_findregion(as, vaddr);
+			KASSERT(rg != NULL && (rg->rg_flags & RG_SHARED));
+		}
+		if (rg != NULL && rg->rg_vn != NULL) {
+			result = pagecache_writeback(rg->rg_vn,
+					region_fileoffset(rg, vaddr),
+					old & PTE_FRAME);
+			if (result) {
+				kprintf("vm: writeback of 0x%x failed: %s\n",
+					vaddr, strerror(result));
+			}
+		}
+		coremap_free(old & PTE_FRAME);
+	}
+	else if (old & PTE_SWAPPED) {
+		swap_free(PTE_SLOT(old));
+	}
+}
+
+/*
+ * pt_walk callback for as_destroy: give back a page's frame or swap
+ * slot. If the page-out daemon is working on it, wait for it to
+ * finish; and coremap_free waits if the daemon has picked the frame
+ * but not got to the PTE yet. So once every page has been through
+ * here, the daemon is done with this address space.
+ */
+static
+int
+as_freepage(vaddr_t vaddr, pte_t *pte, void *data)
+{
+	struct addrspace *as = data;
+	pte_t old;
+
+	spinlock_acquire(&as->as_lock);
+	while (*pte & PTE_BUSY) {
+		swap_waitbusy(as);
+	}
+	old = *pte;
+	*pte = 0;
+	spinlock_release(&as->as_lock);
+
+	as_releasepage(as, vaddr, old);
+	return 0;
+}
+
+void
+as_destroy(struct addrspace *as)
+{
+	struct region *rg;
+	struct addrspace **asp;
+
+	spinlock_acquire(&as_listlock);
+	for (asp = &as_list; *asp != as; asp = &(*asp)->as_next) {
+		KASSERT(*asp != NULL);
+	}
+	*asp = as->as_next;
+	spinlock_release(&as_listlock);
+
+	pt_walk(as->as_pt, as_freepage, as);
+	pt_destroy(as->as_pt);
+	spinlock_cleanup(&as->as_lock);
+
+	while (as->as_regions != NULL) {
+		rg = as->as_regions;
+		as->as_regions = rg->rg_next;
+		region_drop(rg);
+		kfree(rg);
+	}
+	kfree(as);
+}
+
+struct addrspace *
+as_findowner(paddr_t paddr, vaddr_t vaddr)
+{
+	struct addrspace *as;
+	pte_t *pte;
+
+	spinlock_acquire(&as_listlock);
+	for (as = as_list; as != NULL; as = as->as_next) {
+		spinlock_acquire(&as->as_lock);
+		pte = pt_lookup(as->as_pt, vaddr, false);
+		if (pte != NULL &&
+		    (*pte & (PTE_VALID | PTE_SHARED | PTE_FRAME)) ==
+		    (paddr | PTE_VALID)) {
+			spinlock_release(&as->as_lock);
+			break;
+		}
+		spinlock_release(&as->as_lock);
+	}
+	spinlock_release(&as_listlock);
+	return as;
+}
+
+/* State for as_dropmapping. */
+struct as_dropdata {
+	paddr_t paddr;			/* the frame */
+	struct addrspace *as;		/* the address space being walked */
+	struct tlbbatch tb;
+	unsigned count;			/* mappings removed */
+	bool dirty;			/* any of them writable */
+};
+
+/*
+ * pt_walk callback for as_dropshared: unmap the page if it's the
+ * page-cache frame being taken away, unless it has been used since
+ * the clock last came by; then just clear PTE_ACCESSED, and the
+ * frame stays.
+ */
+static
+int
+as_dropmapping(vaddr_t vaddr, pte_t *pte, void *data)
+{
+	struct as_dropdata *dd = data;
+
+	if ((*pte & (PTE_VALID | PTE_SHARED | PTE_FRAME)) !=
+	    (dd->paddr | PTE_VALID | PTE_SHARED)) {
+		return 0;
+	}
+	if (*pte & PTE_ACCESSED) {
+		*pte &= ~PTE_ACCESSED;
+		return 0;
+	}
+	if (*pte & PTE_WRITE) {
+		dd->dirty = true;
+	}
+	*pte = 0;
+	vm_tlbbatch_add(&dd->tb, dd->as, vaddr);
+	dd->count++;
+	return 0;
+}
+
+bool
+as_dropshared(paddr_t paddr)
+{
+	struct as_dropdata dd;
+	struct addrspace *as;
+
+	dd.paddr = paddr;
+	dd.count = 0;
+	dd.dirty = false;
+	vm_tlbbatch_init(&dd.tb);
+
+	/*
+	 * Shared mappings don't record where they are in the coremap,
+	 * so go through every page table. That's slow, but only the
+	 * daemon does it, and only when memory is short.
+	 */
+	spinlock_acquire(&as_listlock);
+	for (as = as_list; as != NULL; as = as->as_next) {
+		dd.as = as;
+		spinlock_acquire(&as->as_lock);
+		pt_walk(as->as_pt, as_dropmapping, &dd);
+		spinlock_release(&as->as_lock);
+	}
+	spinlock_release(&as_listlock);
+
+	/* Nobody can write to the frame any more once this returns. */
+	vm_tlbbatch_finish(&dd.tb);
+
+	/* The page cache's own reference keeps the frame from going. */
+	while (dd.count > 0) {
+		coremap_free(paddr);
+		dd.count--;
+	}
+	return dd.dirty;
+}
+
+struct region *
+as_findregion(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (vaddr < rg->rg_vbase) {
+			/* list is sorted; we've gone past it */
+			return NULL;
+		}
+		if (vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+			return rg;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add a region to the list, keeping it sorted. VADDR and NPAGES must
+ * already be page-aligned. Fails if the region would overlap another
+ * one or run off the top of user space.
+ */
+static
+int
+as_addregion(struct addrspace *as, vaddr_t vaddr, size_t npages, int flags)
+{
+	struct region *rg, **prevp;
+	vaddr_t vtop;
+
+	vtop = vaddr + npages * PAGE_SIZE;
+	if (npages == 0 || vtop > USERSPACETOP || vtop <= vaddr) {
+		return EINVAL;
+	}
+
+	for (prevp = &as->as_regions; *prevp != NULL;
+	     prevp = &(*prevp)->rg_next) {
+		rg = *prevp;
+		if (vtop <= rg->rg_vbase) {
+			break;
+		}
+		if (vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+			return EINVAL;
+		}
+	}
+
+	rg = kmalloc(sizeof(struct region));
+	if (rg == NULL) {
+		return ENOMEM;
+	}
+	rg->rg_vbase = vaddr;
+	rg->rg_npages = npages;
+	rg->rg_flags = flags;
+	rg->rg_vn = NULL;
+	rg->rg_offset = 0;
+	rg->rg_filebase = 0;
+	rg->rg_filesize = 0;
+	rg->rg_advice = MADV_NORMAL;
+	rg->rg_shm = NULL;
+	rg->rg_next = *prevp;
+	*prevp = rg;
+	return 0;
+}
+
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		 int readable, int writeable, int executable)
+{
+	int flags;
+
+	if (sz == 0) {
+		/* Nothing to map. */
+		return 0;
+	}
+
+	/* Align the region. First, the base... */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	flags = 0;
+	if (readable) {
+		flags |= RG_READ;
+	}
+	if (writeable) {
+		flags |= RG_WRITE;
+	}
+	if (executable) {
+		flags |= RG_EXEC;
+	}
+
+	return as_addregion(as, vaddr, sz / PAGE_SIZE, flags);
+}
+
+int
+as_define_fileregion(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+		     struct vnode *vn, off_t offset, size_t filesize,
+		     int readable, int writeable, int executable)
+{
+	struct region *rg;
+	int result;
+
+	KASSERT(filesize <= memsize);
+
+	result = as_define_region(as, vaddr, memsize,
+				  readable, writeable, executable);
+	if (result) {
+		return result;
+	}
+
+	rg = as_findregion(as, vaddr);
+	KASSERT(rg != NULL);
+	VOP_INCREF(vn);
+	rg->rg_vn = vn;
+	rg->rg_offset = offset;
+	rg->rg_filebase = vaddr;
+	rg->rg_filesize = filesize;
+
+	/*
+	 * A read-only segment that is all file data and lines up with
+	 * the file's pages can map the page cache's frames directly, so
+	 * everyone running the program shares one copy. (The parts of
+	 * its first and last pages outside the segment then show the
+	 * neighbouring bytes of the file instead of zeros, which nobody
+	 * has any business looking at.)
+	 */
+	if (!writeable && filesize == memsize &&
+	    vaddr % PAGE_SIZE == offset % PAGE_SIZE) {
+		rg->rg_flags |= RG_SHARED;
+	}
+	return 0;
+}
+
+/*
+ * Find the part [*LO, *HI) of page VADDR that comes from the file.
+ * Returns false if there isn't any.
+ */
+static
+bool
+region_filespan(struct region *rg, vaddr_t vaddr, vaddr_t *lo, vaddr_t *hi)
+{
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	if (rg->rg_vn == NULL) {
+		return false;
+	}
+	*lo = vaddr;
+	*hi = vaddr + PAGE_SIZE;
+	if (*lo < rg->rg_filebase) {
+		*lo = rg->rg_filebase;
+	}
+	if (*hi > rg->rg_filebase + rg->rg_filesize) {
+		*hi = rg->rg_filebase + rg->rg_filesize;
+	}
+	return *lo < *hi;
+}
+
+bool
+region_filepage(struct region *rg, vaddr_t vaddr)
+{
+	vaddr_t lo, hi;
+
+	return region_filespan(rg, vaddr, &lo, &hi);
+}
+
+int
+region_loadpage(struct region *rg, vaddr_t vaddr, paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio u;
+	vaddr_t lo, hi;
+	char *page;
+	int result;
+
+	page = (char *)PADDR_TO_KVADDR(paddr);
+	if (!region_filespan(rg, vaddr, &lo, &hi)) {
+		bzero(page, PAGE_SIZE);
+		return 0;
+	}
+
+	bzero(page, lo - vaddr);
+	bzero(page + (hi - vaddr), vaddr + PAGE_SIZE - hi);
+
+	uio_kinit(&iov, &u, page + (lo - vaddr), hi - lo,
+		  rg->rg_offset + (lo - rg->rg_filebase), UIO_READ);
+	result = VOP_READ(rg->rg_vn, &u);
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		/* short read; problem with executable? */
+		kprintf("ELF: short read on page - file truncated?\n");
+		return EIO;
+	}
+	return 0;
+}
+
+void
+as_unmap(struct addrspace *as, vaddr_t vaddr, size_t npages)
+{
+	struct tlbbatch tb;
+	pte_t *pte, old[TLBSHOOTDOWN_MAX];
+	vaddr_t va;
+	size_t i, n;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	/*
+	 * Work in batches of TLBSHOOTDOWN_MAX pages, so the other
+	 * CPUs get one shootdown for each. The frames can't be
+	 * released until it's done.
+	 */
+	while (npages > 0) {
+		n = npages < TLBSHOOTDOWN_MAX ? npages : TLBSHOOTDOWN_MAX;
+
+		vm_tlbbatch_init(&tb);
+		for (i=0, va=vaddr; i<n; i++, va += PAGE_SIZE) {
+			old[i] = 0;
+			spinlock_acquire(&as->as_lock);
+			pte = pt_lookup(as->as_pt, va, false);
+			if (pte == NULL || *pte == 0) {
+				spinlock_release(&as->as_lock);
+				continue;
+			}
+			while (*pte & PTE_BUSY) {
+				swap_waitbusy(as);
+			}
+			old[i] = *pte;
+			*pte = 0;
+			if (old[i] & PTE_VALID) {
+				vm_tlbbatch_add(&tb, as, va);
+			}
+			spinlock_release(&as->as_lock);
+		}
+		vm_tlbbatch_finish(&tb);
+
+		for (i=0, va=vaddr; i<n; i++, va += PAGE_SIZE) {
+			if (old[i] != 0) {
+				as_releasepage(as, va, old[i]);
+			}
+		}
+
+		vaddr += n * PAGE_SIZE;
+		npages -= n;
+	}
+}
+
+/*
+ * Find room for NPAGES pages of mmap: the highest gap that's big
+ * enough, as long as it's above the heap.
+ */
+static
+int
+as_findgap(struct addrspace *as, size_t npages, vaddr_t *ret)
+{
+	struct region *rg;
+	vaddr_t start, end, found;
+	size_t len;
+
+	len = npages * PAGE_SIZE;
+	found = 0;
+	start = PAGE_SIZE;
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		if (rg->rg_vbase >= start && rg->rg_vbase - start >= len &&
+		    start >= as->as_heapend) {
+			found = rg->rg_vbase - len;
+		}
+		end = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		if (end > start) {
+			start = end;
+		}
+	}
+	if (USERSPACETOP - start >= len && start >= as->as_heapend) {
+		found = USERSPACETOP - len;
+	}
+
+	if (found == 0) {
+		return ENOMEM;
+	}
+	*ret = found;
+	return 0;
+}
+
+int
+as_mmap(struct addrspace *as, vaddr_t vaddr, size_t len, int prot,
+	int flags, struct vnode *vn, off_t offset, vaddr_t *ret)
+{
+	struct region *rg;
+	struct shmseg *seg;
+	struct stat st;
+	size_t npages;
+	int rgflags, result;
+
+	if (len == 0 || len > USERSPACETOP) {
+		return EINVAL;
+	}
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	switch (flags & (MAP_SHARED | MAP_PRIVATE)) {
+	    case MAP_SHARED:
+	    case MAP_PRIVATE:
+		break;
+	    default:
+		return EINVAL;
+	}
+	if (vn != NULL && (offset < 0 || offset % PAGE_SIZE != 0)) {
+		return EINVAL;
+	}
+
+	rgflags = RG_MMAP;
+	if (prot & PROT_READ) {
+		rgflags |= RG_READ;
+	}
+	if (prot & PROT_WRITE) {
+		rgflags |= RG_WRITE;
+	}
+	if (prot & PROT_EXEC) {
+		rgflags |= RG_EXEC;
+	}
+	if (flags & MAP_SHARED) {
+		rgflags |= RG_SHARED;
+	}
+
+	if (vn != NULL && (rgflags & RG_SHARED) == 0) {
+		/* Private copies see the file as it was. */
+		result = VOP_STAT(vn, &st);
+		if (result) {
+			return result;
+		}
+	}
+
+	if (flags & MAP_FIXED) {
+		if ((vaddr & PAGE_FRAME) != vaddr) {
+			return EINVAL;
+		}
+	}
+	else {
+		result = as_findgap(as, npages, &vaddr);
+		if (result) {
+			return result;
+		}
+	}
+
+	/*
+	 * An anonymous MAP_SHARED mapping is backed by a shared memory
+	 * segment of its own that nothing else can find, so a copy of
+	 * the address space shares its pages instead of copying them.
+	 * Like any segment's, they count against the shared memory
+	 * limit and aren't paged out.
+	 */
+	seg = NULL;
+	if (vn == NULL && (rgflags & RG_SHARED)) {
+		result = shm_create(npages * PAGE_SIZE, &seg);
+		if (result) {
+			return result;
+		}
+	}
+
+	result = as_addregion(as, vaddr, npages, rgflags);
+	if (result) {
+		if (seg != NULL) {
+			shm_decref(seg);
+		}
+		return result;
+	}
+
+	if (seg != NULL) {
+		rg = as_findregion(as, vaddr);
+		KASSERT(rg != NULL);
+		rg->rg_shm = seg;
+		rg->rg_filebase = vaddr;
+	}
+	else if (vn != NULL) {
+		rg = as_findregion(as, vaddr);
+		KASSERT(rg != NULL);
+		VOP_INCREF(vn);
+		rg->rg_vn = vn;
+		rg->rg_offset = offset;
+		rg->rg_filebase = vaddr;
+		if (rgflags & RG_SHARED) {
+			rg->rg_filesize = npages * PAGE_SIZE;
+		}
+		else if (offset >= st.st_size) {
+			rg->rg_filesize = 0;
+		}
+		else {
+			rg->rg_filesize = st.st_size - offset < len ?
+				st.st_size - offset : len;
+		}
+	}
+
+	*ret = vaddr;
+	return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct region *rg, *tail, **prevp;
+	vaddr_t end, lo, hi, rgend;
+
+	if ((vaddr & PAGE_FRAME) != vaddr || len == 0 ||
+	    len > USERSPACETOP - vaddr) {
+		return EINVAL;
+	}
+	end = vaddr + ((len + PAGE_SIZE - 1) & PAGE_FRAME);
+
+	/* Only mmap'd memory can be unmapped. */
+	for (rg = as->as_regions; rg != NULL; rg = rg->rg_next) {
+		rgend = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		if (rg->rg_vbase < end && vaddr < rgend &&
+		    (rg->rg_flags & RG_MMAP) == 0) {
+			return EINVAL;
+		}
+	}
+
+	prevp = &as->as_regions;
+	while (*prevp != NULL) {
+		rg = *prevp;
+		rgend = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		if (rg->rg_vbase >= end || vaddr >= rgend) {
+			prevp = &rg->rg_next;
+			continue;
+		}
+		lo = rg->rg_vbase > vaddr ? rg->rg_vbase : vaddr;
+		hi = rgend < end ? rgend : end;
+
+		if (lo > rg->rg_vbase && hi < rgend) {
+			/* Punching a hole; the far side needs its own region. */
+			tail = kmalloc(sizeof(struct region));
+			if (tail == NULL) {
+				return ENOMEM;
+			}
+			*tail = *rg;
+			tail->rg_vbase = hi;
+			tail->rg_npages = (rgend - hi) / PAGE_SIZE;
+			region_hold(tail);
+			as_unmap(as, lo, (hi - lo) / PAGE_SIZE);
+			rg->rg_npages = (lo - rg->rg_vbase) / PAGE_SIZE;
+			tail->rg_next = rg->rg_next;
+			rg->rg_next = tail;
+			prevp = &tail->rg_next;
+			continue;
+		}
+
+		as_unmap(as, lo, (hi - lo) / PAGE_SIZE);
+		if (lo == rg->rg_vbase && hi == rgend) {
+			*prevp = rg->rg_next;
+			region_drop(rg);
+			kfree(rg);
+			continue;
+		}
+		/* Trim one end. The file fields still work as they are. */
+		if (lo == rg->rg_vbase) {
+			rg->rg_vbase = hi;
+		}
+		rg->rg_npages -= (hi - lo) / PAGE_SIZE;
+		prevp = &rg->rg_next;
+	}
+	return 0;
+}
+
+int
+as_msync(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct region *rg;
+	struct tlbbatch tb;
+	vaddr_t end;
+	pte_t *pte;
+	paddr_t pa;
+	int result;
+
+	if ((vaddr & PAGE_FRAME) != vaddr || len > USERSPACETOP - vaddr) {
+		return EINVAL;
+	}
+	end = vaddr + ((len + PAGE_SIZE - 1) & PAGE_FRAME);
+
+	for (; vaddr < end; vaddr += PAGE_SIZE) {
+		rg = as_findregion(as, vaddr);
+		if (rg == NULL) {
+			return ENOMEM;
+		}
+		if ((rg->rg_flags & RG_SHARED) == 0 || rg->rg_vn == NULL) {
+			/* Nothing to write it back to. */
+			continue;
+		}
+
+		/*
+		 * Make the page clean again (write-protecting it, so the
+		 * next write marks it dirty) before writing it, so a
+		 * write made during the I/O isn't lost. Hold a reference
+		 * to the frame meanwhile.
+		 */
+		spinlock_acquire(&as->as_lock);
+		pte = pt_lookup(as->as_pt, vaddr, false);
+		if (pte == NULL || (*pte & PTE_WRITE) == 0) {
+			spinlock_release(&as->as_lock);
+			continue;
+		}
+		KASSERT(*pte & PTE_SHARED);
+		*pte &= ~PTE_WRITE;
+		vm_tlbbatch_init(&tb);
+		vm_tlbbatch_add(&tb, as, vaddr);
+		pa = *pte & PTE_FRAME;
+		coremap_share(pa);
+		spinlock_release(&as->as_lock);
+		vm_tlbbatch_finish(&tb);
+
+		result = pagecache_writeback(rg->rg_vn,
+					     region_fileoffset(rg, vaddr), pa);
+		coremap_free(pa);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	struct region *heap = as->as_heap;
+	vaddr_t newbreak;
+	size_t npages;
+
+	if (heap == NULL) {
+		/* No executable loaded. */
+		return ENOMEM;
+	}
+
+	newbreak = as->as_heapend + amount;
+	if (amount < 0) {
+		if (newbreak > as->as_heapend || newbreak < heap->rg_vbase) {
+			return EINVAL;
+		}
+	}
+	else if (newbreak < as->as_heapend) {
+		return ENOMEM;
+	}
+
+	npages = (newbreak - heap->rg_vbase + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (npages > heap->rg_npages) {
+		/* Don't run into the next region (probably the stack). */
+		if (heap->rg_vbase + npages * PAGE_SIZE > USERSPACETOP ||
+		    (heap->rg_next != NULL &&
+		     heap->rg_vbase + npages * PAGE_SIZE >
+		     heap->rg_next->rg_vbase)) {
+			return ENOMEM;
+		}
+	}
+	else if (npages < heap->rg_npages) {
+		as_unmap(as, heap->rg_vbase + npages * PAGE_SIZE,
+			 heap->rg_npages - npages);
+	}
+
+	heap->rg_npages = npages;
+	*oldbreak = as->as_heapend;
+	as->as_heapend = newbreak;
+	return 0;
+}
+
+/*
+ * Split RG in two at VADDR, which must be a page boundary strictly
+ * inside it.
+ */
+static
+int
+as_splitregion(struct region *rg, vaddr_t vaddr)
+{
+	struct region *tail;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+	KASSERT(vaddr > rg->rg_vbase &&
+		vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE);
+
+	tail = kmalloc(sizeof(struct region));
+	if (tail == NULL) {
+		return ENOMEM;
+	}
+	/* The file fields work for both halves as they are. */
+	*tail = *rg;
+	tail->rg_vbase = vaddr;
+	tail->rg_npages -= (vaddr - rg->rg_vbase) / PAGE_SIZE;
+	region_hold(tail);
+	rg->rg_npages -= tail->rg_npages;
+	rg->rg_next = tail;
+	return 0;
+}
+
+int
+as_madvise(struct addrspace *as, vaddr_t vaddr, size_t len, int advice)
+{
+	struct region *rg;
+	vaddr_t va, end, rgend;
+	int result;
+
+	if ((vaddr & PAGE_FRAME) != vaddr || len > USERSPACETOP - vaddr) {
+		return EINVAL;
+	}
+	end = vaddr + ((len + PAGE_SIZE - 1) & PAGE_FRAME);
+
+	/* It all has to be mapped. */
+	for (va = vaddr; va < end; va = rgend) {
+		rg = as_findregion(as, va);
+		if (rg == NULL) {
+			return ENOMEM;
+		}
+		rgend = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+	}
+
+	switch (advice) {
+	    case MADV_NORMAL:
+	    case MADV_RANDOM:
+	    case MADV_SEQUENTIAL:
+		for (va = vaddr; va < end; va = rgend) {
+			rg = as_findregion(as, va);
+			KASSERT(rg != NULL);
+			if (rg != as->as_heap && va > rg->rg_vbase) {
+				result = as_splitregion(rg, va);
+				if (result) {
+					return result;
+				}
+				rg = rg->rg_next;
+			}
+			rgend = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+			if (rg != as->as_heap && end < rgend) {
+				result = as_splitregion(rg, end);
+				if (result) {
+					return result;
+				}
+				rgend = end;
+			}
+			rg->rg_advice = advice;
+		}
+		return 0;
+
+	    case MADV_WILLNEED:
+		for (va = vaddr; va < end; va += PAGE_SIZE) {
+			rg = as_findregion(as, va);
+			KASSERT(rg != NULL);
+			result = vm_prefetch(as, rg, va);
+			if (result == ENOMEM) {
+				/* It's only advice. */
+				break;
+			}
+			if (result) {
+				return result;
+			}
+		}
+		return 0;
+
+	    case MADV_DONTNEED:
+		as_unmap(as, vaddr, (end - vaddr) / PAGE_SIZE);
+		return 0;
+	}
+	return EINVAL;
+}
+
+int
+as_mincore(struct addrspace *as, vaddr_t vaddr, size_t npages, char *vec)
+{
+	pte_t *pte;
+	size_t i;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	for (i=0; i<npages; i++) {
+		if (as_findregion(as, vaddr + i * PAGE_SIZE) == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	spinlock_acquire(&as->as_lock);
+	for (i=0; i<npages; i++) {
+		pte = pt_lookup(as->as_pt, vaddr + i * PAGE_SIZE, false);
+		vec[i] = (pte != NULL && (*pte & PTE_VALID)) ? 1 : 0;
+	}
+	spinlock_release(&as->as_lock);
+	return 0;
+}
+
+static
+int
+as_countresident(vaddr_t vaddr, pte_t *pte, void *data)
+{
+	unsigned *count = data;
+
+	(void)vaddr;
+	if (*pte & PTE_VALID) {
+		(*count)++;
+	}
+	return 0;
+}
+
+unsigned
+as_resident(struct addrspace *as)
+{
+	unsigned count = 0;
+
+	spinlock_acquire(&as->as_lock);
+	pt_walk(as->as_pt, as_countresident, &count);
+	spinlock_release(&as->as_lock);
+	return count;
+}
+
+int
+as_shmat(struct addrspace *as, struct shmseg *seg, size_t npages,
+	 vaddr_t vaddr, bool readonly, vaddr_t *ret)
+{
+	struct region *rg;
+	int rgflags, result;
+
+	/* RG_MMAP, so munmap works on it as well as shmdt. */
+	rgflags = RG_READ | RG_SHARED | RG_MMAP;
+	if (!readonly) {
+		rgflags |= RG_WRITE;
+	}
+
+	if (vaddr == 0) {
+		result = as_findgap(as, npages, &vaddr);
+		if (result) {
+			return result;
+		}
+	}
+	else if ((vaddr & PAGE_FRAME) != vaddr) {
+		return EINVAL;
+	}
+
+	result = as_addregion(as, vaddr, npages, rgflags);
+	if (result) {
+		return result;
+	}
+	rg = as_findregion(as, vaddr);
+	KASSERT(rg != NULL);
+	rg->rg_shm = seg;
+	rg->rg_filebase = vaddr;
+
+	*ret = vaddr;
+	return 0;
+}
+
+int
+as_shmdt(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+	struct shmseg *seg;
+	vaddr_t end;
+
+	rg = as_findregion(as, vaddr);
+	if (rg == NULL || rg->rg_shm == NULL || rg->rg_vbase != vaddr ||
+	    region_fileoffset(rg, vaddr) != 0) {
+		return EINVAL;
+	}
+
+	/* madvise may have split it up; take all of the pieces. */
+	seg = rg->rg_shm;
+	end = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+	for (rg = rg->rg_next; rg != NULL; rg = rg->rg_next) {
+		if (rg->rg_vbase != end || rg->rg_shm != seg ||
+		    rg->rg_filebase != vaddr) {
+			break;
+		}
+		end += rg->rg_npages * PAGE_SIZE;
+	}
+	return as_munmap(as, vaddr, end - vaddr);
+}
+
+int
+as_prepare_load(struct addrspace *as)
+{
+	/*
+	 * Nothing to do: load_elf only defines the segments, and
+	 * vm_fault reads them in from the file as they're touched.
+	 */
+	(void)as;
+	return 0;
+}
+
+int
+as_complete_load(struct addrspace *as)
+{
+	struct region *rg, *heap;
+
+	/* Start the heap, empty, after the last segment. */
+	if (as->as_regions != NULL && as->as_heap == NULL) {
+		for (rg = as->as_regions; rg->rg_next != NULL;
+		     rg = rg->rg_next) {
+			/* nothing */
+		}
+		heap = kmalloc(sizeof(struct region));
+		if (heap == NULL) {
+			return ENOMEM;
+		}
+		heap->rg_vbase = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+		heap->rg_npages = 0;
+		heap->rg_flags = RG_READ | RG_WRITE;
+		heap->rg_vn = NULL;
+		heap->rg_offset = 0;
+		heap->rg_filebase = 0;
+		heap->rg_filesize = 0;
+		heap->rg_advice = MADV_NORMAL;
+		heap->rg_shm = NULL;
+		heap->rg_next = NULL;
+		rg->rg_next = heap;
+		as->as_heap = heap;
+		as->as_heapend = heap->rg_vbase;
+	}
+
+	return 0;
+}
+
+int
+as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+{
+	int result;
+
+	result = as_addregion(as, USERSTACK - VM_STACKPAGES * PAGE_SIZE,
+			      VM_STACKPAGES, RG_READ | RG_WRITE);
+	if (result) {
+		return result;
+	}
+
+	*stackptr = USERSTACK;
+	return 0;
+}
+
+struct as_copydata {
+	struct addrspace *old;
+	struct addrspace *new;
+};
+
+/*
+ * pt_walk callback for as_copy. A resident page is shared
+ * copy-on-write: both copies of the PTE lose write permission, and
+ * vm_fault gives the writer its own frame (or the frame back, if
+ * nobody else is left using it) on the next write. A page that is
+ * out on swap is read into a new frame for the new address space.
+ */
+static
+int
+as_copypage(vaddr_t vaddr, pte_t *pte, void *data)
+{
+	struct as_copydata *cd = data;
+	struct region *rg;
+	pte_t *newpte, newval;
+	paddr_t pa;
+	unsigned slot;
+	int result;
+
+	spinlock_acquire(&cd->old->as_lock);
+	while (*pte & PTE_BUSY) {
+		swap_waitbusy(cd->old);
+	}
+
+	if (*pte & PTE_SHARED) {
+		/*
+		 * Shared file page: the child maps the same frame. It
+		 * starts out clean; OLD stays dirty if it was.
+		 */
+		coremap_share(*pte & PTE_FRAME);
+		newval = *pte & ~PTE_WRITE;
+		spinlock_release(&cd->old->as_lock);
+	}
+	else if (*pte & PTE_VALID) {
+		coremap_share(*pte & PTE_FRAME);
+		*pte &= ~PTE_WRITE;
+		newval = *pte;
+		spinlock_release(&cd->old->as_lock);
+	}
+	else if (*pte & PTE_SWAPPED) {
+		/* Only we change OLD's non-resident PTEs; the slot stays. */
+		slot = PTE_SLOT(*pte);
+		spinlock_release(&cd->old->as_lock);
+
+		pa = swap_getpage();
+		if (pa == 0) {
+			return ENOMEM;
+		}
+		result = swap_read(slot, pa);
+		if (result) {
+			coremap_free(pa);
+			return result;
+		}
+		newval = pa | PTE_VALID;
+		rg = as_findregion(cd->new, vaddr);
+		if (rg != NULL && (rg->rg_flags & RG_WRITE)) {
+			newval |= PTE_WRITE;
+		}
+	}
+	else {
+		spinlock_release(&cd->old->as_lock);
+		return 0;
+	}
+
+	spinlock_acquire(&cd->new->as_lock);
+	newpte = pt_lookup(cd->new->as_pt, vaddr, true);
+	if (newpte == NULL) {
+		spinlock_release(&cd->new->as_lock);
+		coremap_free(newval & PTE_FRAME);
+		return ENOMEM;
+	}
+	*newpte = newval;
+	coremap_setowner(newval & PTE_FRAME, cd->new, vaddr);
+	spinlock_release(&cd->new->as_lock);
+	return 0;
+}
+
+int
+as_copy(struct addrspace *old, struct addrspace **ret)
+{
+	struct addrspace *new;
+	struct as_copydata cd;
+	struct region *rg, *newrg, **tailp;
+	int result;
+
+	new = as_create();
+	if (new == NULL) {
+		return ENOMEM;
+	}
+
+	/* OLD's list is already sorted, so just append. */
+	tailp = &new->as_regions;
+	for (rg = old->as_regions; rg != NULL; rg = rg->rg_next) {
+		newrg = kmalloc(sizeof(struct region));
+		if (newrg == NULL) {
+			as_destroy(new);
+			return ENOMEM;
+		}
+		*newrg = *rg;
+		newrg->rg_next = NULL;
+		region_hold(newrg);
+		*tailp = newrg;
+		tailp = &newrg->rg_next;
+		if (rg == old->as_heap) {
+			new->as_heap = newrg;
+		}
+	}
+	new->as_heapend = old->as_heapend;
+
+	cd.old = old;
+	cd.new = new;
+	result = pt_walk(old->as_pt, as_copypage, &cd);
+
+	/*
+	 * Pages already shared are read-only in OLD now, even if we
+	 * failed partway; get rid of any writable TLB entries for them.
+	 */
+	vm_tlbinvalidate_as(old);
+
+	if (result) {
+		as_destroy(new);
+		return result;
+	}
+
+	*ret = new;
+	return 0;
+}
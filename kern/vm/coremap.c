@@ -0,0 +1,583 @@
+/*
+ * Coremap: physical page frame allocator.
+ *
+ * See coremap.h for the interface. The free frames are managed as a
+ * binary buddy system indexed by frame number relative to the first
+ * managed frame (cm_base), so block alignment is relative to that
+ * frame and not to physical address zero; nobody cares about the
+ * physical alignment of kernel memory on this machine.
+ *
+ * Single-frame runs holding user pages also record which address
+ * space and virtual page they belong to, so the page-out daemon can
+ * pick them as victims. A frame shared copy-on-write has no single
+ * owner, so sharing it forgets the owner; but every copy maps it at
+ * the same address, so that is kept, and the frame is marked
+ * cme_cow. Once the other copies let go of it, the clock picks it
+ * again without an owner, and the daemon finds out who it is (see
+ * as_findowner).
+ *
+ * Page-cache frames are marked cme_cache. They have no owner either,
+ * and however many mappings they have, the clock can pick them; the
+ * page cache then takes them away from everyone (pagecache_evict).
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <vm.h>
+#include <coremap.h>
+
+/* Largest buddy block is 2^CM_MAXORDER frames (1G with 4k pages). */
+#define CM_MAXORDER 18
+
+/* Null frame index for the free list links. */
+#define CM_NONE ((uint32_t)0xffffffff)
+
+/* Frame states */
+#define CME_FREE      0	/* first frame of a free block on a free list */
+#define CME_INBLOCK   1	/* free, but inside a larger free block */
+#define CME_INUSE     2	/* allocated */
+
+struct coremap_entry {
+	uint32_t cme_next;	/* free list links (frame indices) */
+	uint32_t cme_prev;
+	uint32_t cme_npages;	/* run length; first frame of a run only */
+	uint32_t cme_refcount;	/* references; first frame of a run only */
+	struct addrspace *cme_as;	/* owner, if a pageable user page */
+	vaddr_t cme_va;			/* where the owner has it mapped */
+	uint8_t cme_order;	/* block order; CME_FREE frames only */
+	uint8_t cme_state;	/* CME_* */
+	uint8_t cme_pinned;	/* being paged out; can't be freed yet */
+	uint8_t cme_ref;	/* recently used (for the clock) */
+	uint8_t cme_cow;	/* private page, owner forgotten by sharing */
+	uint8_t cme_cache;	/* page-cache frame */
+};
+
+static struct coremap_entry *coremap;
+static paddr_t cm_base;			/* address of frame 0 */
+static uint32_t cm_nframes;		/* number of managed frames */
+static uint32_t cm_nfree;		/* number of free frames */
+static uint32_t cm_freehead[CM_MAXORDER+1];
+static bool cm_ready;
+static uint32_t cm_hand;		/* clock hand for page-out */
+static struct wchan *cm_pinwchan;	/* for waiting on pinned frames */
+
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+#define CM_INDEX(pa)  (((pa) - cm_base) / PAGE_SIZE)
+#define CM_PADDR(ix)  (cm_base + (paddr_t)(ix) * PAGE_SIZE)
+
+////////////////////////////////////////////////////////////
+//
+// Free list handling
+
+static
+void
+cm_insert(uint32_t ix, unsigned order)
+{
+	struct coremap_entry *e = &coremap[ix];
+
+	e->cme_state = CME_FREE;
+	e->cme_order = order;
+	e->cme_prev = CM_NONE;
+	e->cme_next = cm_freehead[order];
+	if (e->cme_next != CM_NONE) {
+		coremap[e->cme_next].cme_prev = ix;
+	}
+	cm_freehead[order] = ix;
+}
+
+static
+void
+cm_remove(uint32_t ix)
+{
+	struct coremap_entry *e = &coremap[ix];
+
+	KASSERT(e->cme_state == CME_FREE);
+
+	if (e->cme_prev != CM_NONE) {
+		coremap[e->cme_prev].cme_next = e->cme_next;
+	}
+	else {
+		KASSERT(cm_freehead[e->cme_order] == ix);
+		cm_freehead[e->cme_order] = e->cme_next;
+	}
+	if (e->cme_next != CM_NONE) {
+		coremap[e->cme_next].cme_prev = e->cme_prev;
+	}
+	e->cme_state = CME_INBLOCK;
+}
+
+/*
+ * Put a free block back, merging with its buddy as long as the
+ * buddy is also a free block of the same order.
+ */
+static
+void
+cm_freeblock(uint32_t ix, unsigned order)
+{
+	uint32_t buddy;
+
+	while (order < CM_MAXORDER) {
+		buddy = ix ^ ((uint32_t)1 << order);
+		if (buddy >= cm_nframes ||
+		    coremap[buddy].cme_state != CME_FREE ||
+		    coremap[buddy].cme_order != order) {
+			break;
+		}
+		cm_remove(buddy);
+		if (buddy < ix) {
+			ix = buddy;
+		}
+		order++;
+	}
+	cm_insert(ix, order);
+}
+
+/*
+ * Free an arbitrary run of frames by cutting it into the largest
+ * aligned blocks that fit.
+ */
+static
+void
+cm_freerange(uint32_t ix, uint32_t npages)
+{
+	unsigned order;
+
+	cm_nfree += npages;
+	while (npages > 0) {
+		order = 0;
+		while (order < CM_MAXORDER &&
+		       (ix & ((uint32_t)1 << order)) == 0 &&
+		       ((uint32_t)2 << order) <= npages) {
+			order++;
+		}
+		cm_freeblock(ix, order);
+		ix += (uint32_t)1 << order;
+		npages -= (uint32_t)1 << order;
+	}
+}
+
+/*
+ * Get a block of exactly ORDER, splitting a larger one if needed.
+ * Returns CM_NONE if nothing big enough is free.
+ */
+static
+uint32_t
+cm_allocblock(unsigned order)
+{
+	unsigned o;
+	uint32_t ix;
+
+	for (o = order; o <= CM_MAXORDER; o++) {
+		if (cm_freehead[o] != CM_NONE) {
+			break;
+		}
+	}
+	if (o > CM_MAXORDER) {
+		return CM_NONE;
+	}
+
+	ix = cm_freehead[o];
+	cm_remove(ix);
+	while (o > order) {
+		o--;
+		cm_insert(ix + ((uint32_t)1 << o), o);
+	}
+	return ix;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+void
+coremap_bootstrap(void)
+{
+	paddr_t lo, hi;
+	uint32_t npages, cmpages, i;
+
+	ram_getsize(&lo, &hi);
+	KASSERT((lo & PAGE_FRAME) == lo);
+	KASSERT((hi & PAGE_FRAME) == hi);
+
+	/* The coremap itself lives at the bottom of the free memory. */
+	npages = (hi - lo) / PAGE_SIZE;
+	cmpages = DIVROUNDUP(npages * sizeof(struct coremap_entry), PAGE_SIZE);
+	if (cmpages >= npages) {
+		panic("coremap: no memory left to manage\n");
+	}
+
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(lo);
+	cm_base = lo + cmpages * PAGE_SIZE;
+	cm_nframes = npages - cmpages;
+	cm_nfree = 0;
+
+	for (i=0; i<=CM_MAXORDER; i++) {
+		cm_freehead[i] = CM_NONE;
+	}
+	for (i=0; i<cm_nframes; i++) {
+		coremap[i].cme_next = CM_NONE;
+		coremap[i].cme_prev = CM_NONE;
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_refcount = 0;
+		coremap[i].cme_as = NULL;
+		coremap[i].cme_va = 0;
+		coremap[i].cme_order = 0;
+		coremap[i].cme_state = CME_INBLOCK;
+		coremap[i].cme_pinned = 0;
+		coremap[i].cme_ref = 0;
+		coremap[i].cme_cow = 0;
+		coremap[i].cme_cache = 0;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	cm_freerange(0, cm_nframes);
+	cm_ready = true;
+	spinlock_release(&coremap_lock);
+
+	cm_pinwchan = wchan_create("coremap pin");
+	if (cm_pinwchan == NULL) {
+		panic("coremap: wchan_create failed\n");
+	}
+
+	kprintf("coremap: %u frames (%uk) managed, %uk for coremap\n",
+		cm_nframes, cm_nframes * PAGE_SIZE / 1024,
+		cmpages * PAGE_SIZE / 1024);
+}
+
+paddr_t
+coremap_alloc(unsigned long npages)
+{
+	unsigned order;
+	uint32_t ix, i;
+	paddr_t pa;
+
+	KASSERT(npages > 0);
+
+	spinlock_acquire(&coremap_lock);
+
+	if (!cm_ready) {
+		/* Too early; the memory stays allocated forever. */
+		pa = ram_stealmem(npages);
+		spinlock_release(&coremap_lock);
+		return pa;
+	}
+
+	order = 0;
+	while (((unsigned long)1 << order) < npages) {
+		order++;
+	}
+	if (order > CM_MAXORDER || npages > cm_nfree) {
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+
+	ix = cm_allocblock(order);
+	if (ix == CM_NONE) {
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+	cm_nfree -= (uint32_t)1 << order;
+
+	/* Give back the tail past the end of the run. */
+	if (npages < ((unsigned long)1 << order)) {
+		cm_freerange(ix + npages, ((uint32_t)1 << order) - npages);
+	}
+
+	for (i=0; i<npages; i++) {
+		coremap[ix+i].cme_state = CME_INUSE;
+		coremap[ix+i].cme_npages = 0;
+	}
+	coremap[ix].cme_npages = npages;
+	coremap[ix].cme_refcount = 1;
+
+	spinlock_release(&coremap_lock);
+	return CM_PADDR(ix);
+}
+
+void
+coremap_free(paddr_t paddr)
+{
+	uint32_t ix, npages, i;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	spinlock_acquire(&coremap_lock);
+
+	if (!cm_ready || paddr < cm_base) {
+		/* Came from ram_stealmem; can't be given back. */
+		spinlock_release(&coremap_lock);
+		return;
+	}
+
+	ix = CM_INDEX(paddr);
+	KASSERT(ix < cm_nframes);
+	if (coremap[ix].cme_state != CME_INUSE ||
+	    coremap[ix].cme_npages == 0) {
+		panic("coremap_free: 0x%x is not the start of a run\n",
+		      paddr);
+	}
+
+	KASSERT(coremap[ix].cme_refcount > 0);
+	if (coremap[ix].cme_refcount > 1) {
+		/* Still in use by someone else. */
+		coremap[ix].cme_refcount--;
+		spinlock_release(&coremap_lock);
+		return;
+	}
+
+	/* The page-out daemon may still be looking at it. */
+	while (coremap[ix].cme_pinned) {
+		wchan_lock(cm_pinwchan);
+		spinlock_release(&coremap_lock);
+		wchan_sleep(cm_pinwchan);
+		spinlock_acquire(&coremap_lock);
+	}
+	KASSERT(coremap[ix].cme_refcount == 1);
+	coremap[ix].cme_refcount = 0;
+	coremap[ix].cme_as = NULL;
+	coremap[ix].cme_va = 0;
+	coremap[ix].cme_ref = 0;
+	coremap[ix].cme_cow = 0;
+	coremap[ix].cme_cache = 0;
+
+	npages = coremap[ix].cme_npages;
+	for (i=0; i<npages; i++) {
+		KASSERT(coremap[ix+i].cme_state == CME_INUSE);
+		coremap[ix+i].cme_state = CME_INBLOCK;
+		coremap[ix+i].cme_npages = 0;
+	}
+	cm_freerange(ix, npages);
+
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Look up the coremap entry for the start of a run, with the lock
+ * held. Returns NULL for memory that came from ram_stealmem.
+ */
+static
+struct coremap_entry *
+cm_runhead(paddr_t paddr)
+{
+	uint32_t ix;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	if (!cm_ready || paddr < cm_base) {
+		return NULL;
+	}
+	ix = CM_INDEX(paddr);
+	KASSERT(ix < cm_nframes);
+	KASSERT(coremap[ix].cme_state == CME_INUSE);
+	KASSERT(coremap[ix].cme_npages > 0);
+	return &coremap[ix];
+}
+
+void
+coremap_share(paddr_t paddr)
+{
+	struct coremap_entry *e;
+
+	spinlock_acquire(&coremap_lock);
+	e = cm_runhead(paddr);
+	if (e != NULL) {
+		KASSERT(e->cme_refcount > 0);
+		e->cme_refcount++;
+		/*
+		 * Nobody owns it alone any more. If it's a private
+		 * page, every copy has it at the same address.
+		 */
+		if (e->cme_as != NULL) {
+			e->cme_cow = 1;
+		}
+		e->cme_as = NULL;
+		if (!e->cme_cow) {
+			e->cme_va = 0;
+		}
+	}
+	spinlock_release(&coremap_lock);
+}
+
+unsigned
+coremap_refcount(paddr_t paddr)
+{
+	struct coremap_entry *e;
+	unsigned ret;
+
+	spinlock_acquire(&coremap_lock);
+	e = cm_runhead(paddr);
+	ret = (e != NULL) ? e->cme_refcount : 1;
+	spinlock_release(&coremap_lock);
+	return ret;
+}
+
+void
+coremap_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *e;
+
+	spinlock_acquire(&coremap_lock);
+	e = cm_runhead(paddr);
+	if (e != NULL && e->cme_refcount == 1) {
+		KASSERT(e->cme_npages == 1);
+		e->cme_as = as;
+		e->cme_va = vaddr;
+		e->cme_ref = 1;
+		e->cme_cow = 0;
+	}
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_setcached(paddr_t paddr)
+{
+	struct coremap_entry *e;
+
+	spinlock_acquire(&coremap_lock);
+	e = cm_runhead(paddr);
+	if (e != NULL) {
+		KASSERT(e->cme_npages == 1 && e->cme_as == NULL);
+		e->cme_cache = 1;
+		e->cme_ref = 1;
+	}
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_markref(paddr_t paddr)
+{
+	uint32_t ix;
+
+	/*
+	 * No lock: this is called on every TLB load, and losing a
+	 * reference bit to a race just costs the page its second
+	 * chance.
+	 */
+	if (cm_ready && paddr >= cm_base) {
+		ix = CM_INDEX(paddr);
+		KASSERT(ix < cm_nframes);
+		coremap[ix].cme_ref = 1;
+	}
+}
+
+void
+coremap_clearref(paddr_t paddr)
+{
+	uint32_t ix;
+
+	/* No lock, as for coremap_markref. */
+	if (cm_ready && paddr >= cm_base) {
+		ix = CM_INDEX(paddr);
+		KASSERT(ix < cm_nframes);
+		coremap[ix].cme_ref = 0;
+	}
+}
+
+paddr_t
+coremap_pickvictim(struct addrspace **as, vaddr_t *vaddr, bool *cached)
+{
+	struct coremap_entry *e;
+	uint32_t n, ix;
+
+	spinlock_acquire(&coremap_lock);
+
+	/* Two passes: the first one may just be clearing ref bits. */
+	for (n=0; n < 2 * cm_nframes; n++) {
+		ix = cm_hand;
+		cm_hand = (cm_hand + 1) % cm_nframes;
+
+		e = &coremap[ix];
+		if (e->cme_state != CME_INUSE || e->cme_pinned) {
+			continue;
+		}
+		if (!e->cme_cache &&
+		    ((e->cme_as == NULL && !e->cme_cow) ||
+		     e->cme_refcount != 1)) {
+			continue;
+		}
+		if (e->cme_ref) {
+			e->cme_ref = 0;
+			continue;
+		}
+
+		e->cme_pinned = 1;
+		*as = e->cme_as;
+		*vaddr = e->cme_va;
+		*cached = e->cme_cache != 0;
+		spinlock_release(&coremap_lock);
+		return CM_PADDR(ix);
+	}
+
+	spinlock_release(&coremap_lock);
+	return 0;
+}
+
+bool
+coremap_trypin(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *e;
+	bool pinned;
+
+	spinlock_acquire(&coremap_lock);
+	e = cm_runhead(paddr);
+	pinned = e != NULL && e->cme_as == as && e->cme_va == vaddr &&
+		!e->cme_pinned && !e->cme_ref && e->cme_refcount == 1;
+	if (pinned) {
+		e->cme_pinned = 1;
+	}
+	spinlock_release(&coremap_lock);
+	return pinned;
+}
+
+void
+coremap_unpin(paddr_t paddr)
+{
+	struct coremap_entry *e;
+
+	spinlock_acquire(&coremap_lock);
+	e = cm_runhead(paddr);
+	KASSERT(e != NULL && e->cme_pinned);
+	e->cme_pinned = 0;
+	spinlock_release(&coremap_lock);
+
+	wchan_wakeall(cm_pinwchan);
+}
+
+unsigned
+coremap_freecount(void)
+{
+	return cm_nfree;
+}
+
+void
+coremap_printstats(void)
+{
+	uint32_t nframes, nfree, nblocks[CM_MAXORDER+1];
+	uint32_t ix;
+	unsigned i;
+
+	spinlock_acquire(&coremap_lock);
+	nframes = cm_nframes;
+	nfree = cm_nfree;
+	for (i=0; i<=CM_MAXORDER; i++) {
+		nblocks[i] = 0;
+		for (ix = cm_freehead[i]; ix != CM_NONE;
+		     ix = coremap[ix].cme_next) {
+			nblocks[i]++;
+		}
+	}
+	spinlock_release(&coremap_lock);
+
+	kprintf("Coremap: %u of %u frames free\n", nfree, nframes);
+	kprintf("   free blocks by order:");
+	for (i=0; i<=CM_MAXORDER; i++) {
+		if (nblocks[i] > 0) {
+			kprintf(" %u:%u", i, nblocks[i]);
+		}
+	}
+	kprintf("\n");
+}
@@ -29,8 +29,12 @@
 
 #include <types.h>
 #include <lib.h>
+#include <cpu.h>
 #include <spinlock.h>
+#include <current.h>
+#include <platform/maxcpus.h>
 #include <vm.h>
+#include "opt-kmallocprof.h"
 
 /*
  * Kernel malloc.
@@ -70,10 +74,11 @@ fill_deadbeef(void *vptr, size_t len)
 //    more blocks would fit on a page than with the existing block
 //    sizes, and large numbers of items of the new size are allocated.
 //
-//    The free counts and addresses of the pages are maintained in
-//    another list.  Maintaining this table is a nuisance, because it
-//    cannot recursively use the subpage allocator. (We could probably
-//    make that work, but it would be painful.)
+//    The free counts and addresses of the pages are kept in pagerefs,
+//    in a table indexed by page (so kfree can find one from a block's
+//    address) and on lists by size. The table's pages come straight
+//    from alloc_kpages, because it cannot recursively use the subpage
+//    allocator.
 //
 
 #undef  SLOW	/* consistency checks */
@@ -117,85 +122,182 @@ struct pageref {
 
 ////////////////////////////////////////
 
+static struct pageref *sizebases[NSIZES];
+static struct pageref *allbase;
+
 /*
- * This is cheesy. 
+ * When a page empties out we keep up to KMALLOC_RESERVE of them per
+ * size, so a burst of allocating and freeing the same size doesn't
+ * bounce pages to and from the VM system. Any more are given back.
+ */
+#define KMALLOC_RESERVE 2
+static unsigned nempty[NSIZES];		/* empty pages of each size */
+static unsigned pages_taken;		/* pages gotten from alloc_kpages */
+static unsigned pages_returned;		/* pages given back */
+
+/*
+ * Per-cpu magazines.
+ *
+ * Each cpu keeps a magazine (a small stack) of free blocks of each
+ * size. Most of the time kmalloc pops a block off the current cpu's
+ * magazine and kfree pushes one on, and nobody else touches it, so
+ * no shared lock is needed. When a magazine runs dry we refill half
+ * of it from the pages in one trip under kmalloc_spinlock, and when
+ * it fills up we send half of it back the same way.
  *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
+ * Blocks sitting in magazines count as allocated as far as their
+ * pages are concerned, so magazines are kept small (KMAG_BYTES of
+ * each size at most) and kheap_reclaim empties them all.
  *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
+ * Each cpu's magazines have a spinlock, which keeps us on the cpu
+ * while we use them and lets kheap_reclaim get at them from outside;
+ * it is only ever contended by kheap_reclaim. If we get moved to
+ * another cpu between looking up the magazines and locking them,
+ * we use the old cpu's; this is harmless. The kmcpu for a cpu is
+ * made the first time it allocates something, and never goes away.
+ */
+#define KMAG_MAX    16			/* most blocks in a magazine */
+#define KMAG_BYTES  (PAGE_SIZE/2)	/* most bytes in a magazine */
+
+struct kmagazine {
+	unsigned km_count;
+	void *km_objs[KMAG_MAX];
+};
+
+struct kmcpu {
+	struct spinlock kc_lock;
+	struct kmagazine kc_mags[NSIZES];
+};
+
+static struct kmcpu *kmalloc_cpus[MAXCPUS];
+
+////////////////////////////////////////
+
+/*
+ * Use one spinlock for all the pages and lists. Most allocations and
+ * frees don't get this far, though; they are served from per-cpu
+ * magazines (below), and only come here to refill or flush one.
+ */
+
+static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+
+////////////////////////////////////////
+
+/*
+ * The pagerefs live in a table indexed by page number, so kfree can
+ * go straight from a block's address to its page's pageref without
+ * searching the lists, and there is no fixed limit on how many there
+ * can be. A pageref whose pageaddr_and_blocktype is 0 is not in use
+ * (no page in kseg0 is at address 0). Pagerefs are set up and torn
+ * down under the lock, but PR_BLOCKTYPE may be read without it by
+ * anyone with a live block on the page, because then the page can't
+ * be given back underneath them.
  *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * There are two levels, so we only pay for the parts of memory
+ * kmalloc actually gets pages from: each second-level table is one
+ * page of pagerefs, covering PRT_SPAN bytes of kseg0.
  */
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+#define PRT_ENTRIES  (PAGE_SIZE / sizeof(struct pageref))
+#define PRT_SPAN     ((vaddr_t)PRT_ENTRIES * PAGE_SIZE)
+#define PRT_NTABLES  ((MIPS_KSEG1 - MIPS_KSEG0) / PRT_SPAN)
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+static struct pageref *pageref_tables[PRT_NTABLES];
 
+/*
+ * Return the pageref for the page holding VA, or NULL if that page
+ * isn't a subpage page.
+ */
 static
 struct pageref *
-allocpageref(void)
+pageref_lookup(vaddr_t va)
 {
-	unsigned i,j;
-	uint32_t k;
+	struct pageref *table, *pr;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
-		}
-		KASSERT(0);
+	if (va < MIPS_KSEG0 || va >= MIPS_KSEG1) {
+		return NULL;
 	}
-
-	/* ran out */
-	return NULL;
+	va -= MIPS_KSEG0;
+	table = pageref_tables[va / PRT_SPAN];
+	if (table == NULL) {
+		return NULL;
+	}
+	pr = &table[(va % PRT_SPAN) / PAGE_SIZE];
+	if (pr->pageaddr_and_blocktype == 0) {
+		return NULL;
+	}
+	return pr;
 }
 
+/*
+ * Make sure there is a table for the page VA, which we just got from
+ * alloc_kpages. Called without the lock. Returns nonzero if we can't
+ * get the memory.
+ */
 static
-void
-freepageref(struct pageref *p)
+int
+pageref_prepare(vaddr_t va)
 {
-	size_t i, j;
-	uint32_t k;
+	unsigned n;
+	vaddr_t table;
 
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
-}
+	KASSERT(va >= MIPS_KSEG0 && va < MIPS_KSEG1);
+	n = (va - MIPS_KSEG0) / PRT_SPAN;
+	if (pageref_tables[n] != NULL) {
+		return 0;
+	}
 
-////////////////////////////////////////
+	table = alloc_kpages(1);
+	if (table == 0) {
+		return 1;
+	}
+	bzero((void *)table, PAGE_SIZE);
 
-static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
+	spinlock_acquire(&kmalloc_spinlock);
+	if (pageref_tables[n] == NULL) {
+		pageref_tables[n] = (struct pageref *)table;
+		table = 0;
+	}
+	spinlock_release(&kmalloc_spinlock);
 
-////////////////////////////////////////
+	if (table != 0) {
+		/* Someone else made it first. */
+		free_kpages(table);
+	}
+	return 0;
+}
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Set up the pageref for the page PRPAGE, which pageref_prepare has
+ * been called for.
  */
+static
+struct pageref *
+allocpageref(vaddr_t prpage, int blktype)
+{
+	struct pageref *pr;
+	vaddr_t va;
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(prpage >= MIPS_KSEG0 && prpage < MIPS_KSEG1);
+
+	va = prpage - MIPS_KSEG0;
+	KASSERT(pageref_tables[va / PRT_SPAN] != NULL);
+	pr = &pageref_tables[va / PRT_SPAN][(va % PRT_SPAN) / PAGE_SIZE];
+	KASSERT(pr->pageaddr_and_blocktype == 0);
+
+	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
+	return pr;
+}
+
+static
+void
+freepageref(struct pageref *pr)
+{
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->pageaddr_and_blocktype != 0);
+	pr->pageaddr_and_blocktype = 0;
+}
 
 ////////////////////////////////////////
 
@@ -260,14 +362,15 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(pageref_lookup(PR_PAGEADDR(pr)) == pr);
+			KASSERT(sc < pages_taken - pages_returned);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(ac < pages_taken - pages_returned);
 		ac++;
 	}
 
@@ -330,10 +433,241 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+#if OPT_KMALLOCPROF
+////////////////////////////////////////////////////////////
+//
+// Allocation profiling (options kmallocprof).
+//
+// Every kmalloc is charged to its call site, that is, the address
+// kmalloc returns to, and to the size class it lands in. A header in
+// front of each block remembers the size asked for and the site, so
+// kfree can take the charges back off. Sites are kept in a small hash
+// table; once it is full, new sites are lumped together as "other".
+// Feed the site addresses to addr2line to find the code. Everything
+// kstrdup allocates shows up as kstrdup.
+//
+// The header pushes some requests up a size class, and whole-page
+// requests into an extra page, so the numbers are a guide to leaks
+// and to choosing size classes rather than an exact account of what
+// an unprofiled kernel uses. The header is counted as waste.
+//
+
+#define KPROF_NSITES  128		/* call sites we keep track of */
+#define KPROF_OTHER   (KPROF_NSITES-1)	/* where the rest are charged */
+#define KPROF_TOPN    20		/* sites kh prints */
+#define KPROF_MAGIC   0x6b70
+
+struct kprof_hdr {
+	uint32_t kh_size;	/* bytes asked for */
+	uint16_t kh_site;	/* index into kprof_sites */
+	uint16_t kh_magic;	/* KPROF_MAGIC while allocated */
+};
+
+struct kprof_site {
+	vaddr_t ks_addr;	/* call site, or 0 if slot unused */
+	size_t ks_live;		/* bytes allocated and not yet freed */
+	size_t ks_peak;		/* largest ks_live has been */
+	unsigned ks_allocs;
+	unsigned ks_frees;
+};
+
+struct kprof_class {
+	unsigned kc_allocs;	/* allocations ever */
+	unsigned kc_live;	/* allocations not yet freed */
+	size_t kc_requested;	/* bytes asked for by those */
+	size_t kc_rounded;	/* bytes they actually take */
+};
+
+static struct kprof_site kprof_sites[KPROF_NSITES];
+static struct kprof_class kprof_classes[NSIZES+1];	/* last: whole pages */
+static struct spinlock kprof_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Find (or make) the slot for call site ADDR.
+ */
+static
+unsigned
+kprof_site(vaddr_t addr)
+{
+	unsigned i, n;
+
+	KASSERT(spinlock_do_i_hold(&kprof_lock));
+	KASSERT(addr != 0);
+
+	i = (addr >> 2) % KPROF_OTHER;
+	for (n=0; n<KPROF_OTHER; n++) {
+		if (kprof_sites[i].ks_addr == addr) {
+			return i;
+		}
+		if (kprof_sites[i].ks_addr == 0) {
+			kprof_sites[i].ks_addr = addr;
+			return i;
+		}
+		i = (i + 1) % KPROF_OTHER;
+	}
+	kprof_sites[KPROF_OTHER].ks_addr = 1;
+	return KPROF_OTHER;
+}
+
+/*
+ * Charge the block with header HDR, SZ bytes asked for at ADDR, which
+ * went in size class CLS and takes ROUNDED bytes.
+ */
+static
+void
+kprof_charge(struct kprof_hdr *hdr, size_t sz, vaddr_t addr,
+	     unsigned cls, size_t rounded)
+{
+	struct kprof_site *ks;
+	struct kprof_class *kc;
+
+	spinlock_acquire(&kprof_lock);
+
+	hdr->kh_size = sz;
+	hdr->kh_site = kprof_site(addr);
+	hdr->kh_magic = KPROF_MAGIC;
+
+	ks = &kprof_sites[hdr->kh_site];
+	ks->ks_live += sz;
+	if (ks->ks_live > ks->ks_peak) {
+		ks->ks_peak = ks->ks_live;
+	}
+	ks->ks_allocs++;
+
+	kc = &kprof_classes[cls];
+	kc->kc_allocs++;
+	kc->kc_live++;
+	kc->kc_requested += sz;
+	kc->kc_rounded += rounded;
+
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Undo kprof_charge for the block with header HDR.
+ */
+static
+void
+kprof_uncharge(struct kprof_hdr *hdr, unsigned cls, size_t rounded)
+{
+	struct kprof_site *ks;
+	struct kprof_class *kc;
+
+	spinlock_acquire(&kprof_lock);
+
+	KASSERT(hdr->kh_site < KPROF_NSITES);
+	ks = &kprof_sites[hdr->kh_site];
+	KASSERT(ks->ks_live >= hdr->kh_size);
+	ks->ks_live -= hdr->kh_size;
+	ks->ks_frees++;
+
+	kc = &kprof_classes[cls];
+	KASSERT(kc->kc_live > 0);
+	kc->kc_live--;
+	kc->kc_requested -= hdr->kh_size;
+	kc->kc_rounded -= rounded;
+
+	/* Catches most double frees. */
+	hdr->kh_magic = 0;
+
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Print the KPROF_TOPN sites with the most live bytes, and how much
+ * each size class is wasting.
+ */
+static
+void
+kprof_print(void)
+{
+	uint32_t shown[KPROF_NSITES/32];
+	struct kprof_site *ks, *best;
+	struct kprof_class *kc;
+	unsigned i, j, bestix, waste;
+
+	bzero(shown, sizeof(shown));
+
+	spinlock_acquire(&kprof_lock);
+
+	kprintf("kmalloc call sites (top %u by live bytes):\n", KPROF_TOPN);
+	kprintf("  %-10s %8s %8s %8s %8s\n",
+		"site", "live", "peak", "allocs", "frees");
+	for (i=0; i<KPROF_TOPN; i++) {
+		best = NULL;
+		bestix = 0;
+		for (j=0; j<KPROF_NSITES; j++) {
+			ks = &kprof_sites[j];
+			if (ks->ks_addr == 0 || (shown[j/32] & (1U << (j%32)))) {
+				continue;
+			}
+			if (best == NULL || ks->ks_live > best->ks_live ||
+			    (ks->ks_live == best->ks_live &&
+			     ks->ks_peak > best->ks_peak)) {
+				best = ks;
+				bestix = j;
+			}
+		}
+		if (best == NULL) {
+			break;
+		}
+		shown[bestix/32] |= 1U << (bestix%32);
+
+		if (bestix == KPROF_OTHER) {
+			kprintf("  %-10s ", "(other)");
+		}
+		else {
+			kprintf("  0x%08lx ", (unsigned long)best->ks_addr);
+		}
+		kprintf("%8u %8u %8u %8u\n", (unsigned)best->ks_live,
+			(unsigned)best->ks_peak, best->ks_allocs,
+			best->ks_frees);
+	}
+
+	kprintf("kmalloc size classes (live blocks):\n");
+	kprintf("  %6s %8s %8s %9s %9s %6s\n",
+		"size", "allocs", "live", "requested", "rounded", "waste");
+	for (i=0; i<=NSIZES; i++) {
+		kc = &kprof_classes[i];
+		waste = 0;
+		if (kc->kc_rounded > 0) {
+			waste = (kc->kc_rounded - kc->kc_requested) * 100 /
+				kc->kc_rounded;
+		}
+		if (i < NSIZES) {
+			kprintf("  %6u ", (unsigned)sizes[i]);
+		}
+		else {
+			kprintf("  %6s ", "pages");
+		}
+		kprintf("%8u %8u %9u %9u %5u%%\n", kc->kc_allocs,
+			kc->kc_live, (unsigned)kc->kc_requested,
+			(unsigned)kc->kc_rounded, waste);
+	}
+
+	spinlock_release(&kprof_lock);
+}
+
+//
+////////////////////////////////////////////////////////////
+#endif /* OPT_KMALLOCPROF */
+
 void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	unsigned i, j, empty, cached;
+
+	/* Not exact, since the cpus keep going; close enough. */
+	cached = 0;
+	for (i=0; i<MAXCPUS; i++) {
+		if (kmalloc_cpus[i] == NULL) {
+			continue;
+		}
+		for (j=0; j<NSIZES; j++) {
+			cached += kmalloc_cpus[i]->kc_mags[j].km_count;
+		}
+	}
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -344,7 +678,19 @@ kheap_printstats(void)
 		dumpsubpage(pr);
 	}
 
+	empty = 0;
+	for (i=0; i<NSIZES; i++) {
+		empty += nempty[i];
+	}
+	kprintf("%u pages taken, %u returned, %u empty in reserve\n",
+		pages_taken, pages_returned, empty);
+	kprintf("%u blocks in per-cpu magazines (shown as in use)\n", cached);
+
 	spinlock_release(&kmalloc_spinlock);
+
+#if OPT_KMALLOCPROF
+	kprof_print();
+#endif
 }
 
 ////////////////////////////////////////
@@ -392,63 +738,122 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Take one block off page PR's freelist.
+ */
 static
 void *
-subpage_kmalloc(size_t sz)
+subpage_pop(struct pageref *pr)
 {
-	unsigned blktype;	// index into sizes[] that we're using
-	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
+	struct freelist *fl;	// free list entry
 	void *retptr;		// our result
 
-	volatile int i;
-
-
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
 
-	spinlock_acquire(&kmalloc_spinlock);
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
 
-	checksubpages();
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
 
-		/* check for corruption */
-		KASSERT(PR_BLOCKTYPE(pr) == blktype);
-		checksubpage(pr);
+	return retptr;
+}
 
-		if (pr->nfree > 0) {
+/*
+ * Take up to N blocks of type BLKTYPE off the existing pages into
+ * OBJS. Returns how many we got.
+ */
+static
+unsigned
+subpage_take(unsigned blktype, void **objs, unsigned n)
+{
+	struct pageref *pr;	// pageref for page we're allocating from
+	struct pageref *empty;	// an empty page, if we find one
+	unsigned got;
 
-		doalloc: /* comes here after getting a whole fresh page */
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
+	got = 0;
+	while (got < n) {
+		empty = NULL;
+		for (pr = sizebases[blktype]; pr != NULL;
+		     pr = pr->next_samesize) {
 
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
+			/* check for corruption */
+			KASSERT(PR_BLOCKTYPE(pr) == blktype);
+			checksubpage(pr);
 
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
+			if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+				/* Use empty pages last, so they can be given back. */
+				if (empty == NULL) {
+					empty = pr;
+				}
+				continue;
 			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
+			if (pr->nfree > 0) {
+				break;
 			}
+		}
 
-			checksubpages();
+		if (pr == NULL) {
+			if (empty == NULL) {
+				break;
+			}
+			KASSERT(nempty[blktype] > 0);
+			nempty[blktype]--;
+			pr = empty;
+		}
 
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
+		while (got < n && pr->nfree > 0) {
+			objs[got++] = subpage_pop(pr);
 		}
 	}
+	return got;
+}
+
+/*
+ * Get up to N blocks of type BLKTYPE into OBJS, making a new page if
+ * there are none. Returns how many we got; 0 means we're out of
+ * memory.
+ */
+static
+unsigned
+subpage_getblocks(unsigned blktype, void **objs, unsigned n)
+{
+	struct pageref *pr;	// pageref for the new page
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
+	unsigned got;
+
+	volatile int i;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+
+	got = subpage_take(blktype, objs, n);
+	if (got > 0) {
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+		return got;
+	}
 
 	/*
 	 * No page of the right size available.
@@ -464,20 +869,19 @@ subpage_kmalloc(size_t sz)
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
-		return NULL;
+		return 0;
 	}
-	spinlock_acquire(&kmalloc_spinlock);
-
-	pr = allocpageref();
-	if (pr==NULL) {
+	if (pageref_prepare(prpage)) {
 		/* Couldn't allocate accounting space for the new page. */
-		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
 		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+		return 0;
 	}
+	spinlock_acquire(&kmalloc_spinlock);
+
+	pr = allocpageref(prpage, blktype);
+	pages_taken++;
 
-	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
 
 	/*
@@ -504,51 +908,264 @@ subpage_kmalloc(size_t sz)
 	pr->next_all = allbase;
 	allbase = pr;
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	/* It's empty until subpage_take gets to it. */
+	nempty[blktype]++;
+
+	got = subpage_take(blktype, objs, n);
+	KASSERT(got > 0);
+
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+	return got;
 }
 
+/*
+ * Put the N blocks in OBJS back on their pages, giving back any pages
+ * that empty out beyond the reserve. The blocks have already been
+ * filled with 0xdeadbeef.
+ */
 static
-int
-subpage_kfree(void *ptr)
+void
+subpage_putblocks(void **objs, unsigned n)
 {
 	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
+	vaddr_t ptraddr;	// address of the block
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
 	struct freelist *fl;	// free list entry
+	struct freelist *dead;	// pages to give back
 	vaddr_t offset;		// offset into page
+	unsigned j;
 
-	ptraddr = (vaddr_t)ptr;
+	dead = NULL;
 
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
+	for (j=0; j<n; j++) {
+		ptraddr = (vaddr_t)objs[j];
+		pr = pageref_lookup(ptraddr);
+		/* kfree found it, so it must be here */
+		KASSERT(pr != NULL);
+		checksubpage(pr);
 		prpage = PR_PAGEADDR(pr);
 		blktype = PR_BLOCKTYPE(pr);
 
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
+		offset = ptraddr - prpage;
+		KASSERT(offset < PAGE_SIZE && offset % sizes[blktype] == 0);
 
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
+		/*
+		 * We probably ought to check for free twice by seeing if
+		 * the block is already on the free list. But that's
+		 * expensive, so we don't.
+		 */
+
+		fl = (struct freelist *)ptraddr;
+		if (pr->freelist_offset == INVALID_OFFSET) {
+			fl->next = NULL;
+		} else {
+			fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+		}
+		pr->freelist_offset = offset;
+		pr->nfree++;
+
+		KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+		if (pr->nfree != PAGE_SIZE / sizes[blktype]) {
+			continue;
+		}
+
+		if (nempty[blktype] < KMALLOC_RESERVE) {
+			/* Whole page is free; keep it in reserve. */
+			nempty[blktype]++;
+		}
+		else {
+			/* Whole page is free, and we have enough. */
+			remove_lists(pr, blktype);
+			freepageref(pr);
+			pages_returned++;
+			fl = (struct freelist *)prpage;
+			fl->next = dead;
+			dead = fl;
 		}
 	}
 
-	if (pr==NULL) {
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	while (dead != NULL) {
+		fl = dead;
+		dead = fl->next;
+		free_kpages((vaddr_t)fl);
+	}
+}
+
+//
+////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////
+//
+// Per-cpu magazines. See the comment up top.
+//
+
+/*
+ * How many blocks of type BLKTYPE a magazine holds, and how many we
+ * move at once when it runs dry or fills up.
+ */
+static
+unsigned
+kmag_size(unsigned blktype)
+{
+	unsigned n;
+
+	n = KMAG_BYTES / sizes[blktype];
+	if (n > KMAG_MAX) {
+		n = KMAG_MAX;
+	}
+	return n > 0 ? n : 1;
+}
+
+static
+unsigned
+kmag_batch(unsigned blktype)
+{
+	return (kmag_size(blktype) + 1) / 2;
+}
+
+/*
+ * Return the current cpu's magazines. If it doesn't have any yet,
+ * make them if CREATE is set, and otherwise return NULL. Also returns
+ * NULL early in boot, before there is a curcpu, or if we can't get the
+ * memory; the caller then goes straight to the pages.
+ */
+static
+struct kmcpu *
+kmcpu_get(bool create)
+{
+	struct kmcpu *kc;
+	void *ptr;
+	unsigned num, i;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	num = curcpu->c_number;
+	KASSERT(num < MAXCPUS);
+
+	kc = kmalloc_cpus[num];
+	if (kc != NULL || !create) {
+		return kc;
+	}
+
+	if (subpage_getblocks(blocktype(sizeof(*kc)), &ptr, 1) == 0) {
+		return NULL;
+	}
+	kc = ptr;
+	spinlock_init(&kc->kc_lock);
+	for (i=0; i<NSIZES; i++) {
+		kc->kc_mags[i].km_count = 0;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	if (kmalloc_cpus[num] == NULL) {
+		kmalloc_cpus[num] = kc;
+		ptr = NULL;
+	}
+	kc = kmalloc_cpus[num];
+	spinlock_release(&kmalloc_spinlock);
+
+	if (ptr != NULL) {
+		/* Another thread got here first (we moved cpus). */
+		fill_deadbeef(ptr, sizes[blocktype(sizeof(*kc))]);
+		subpage_putblocks(&ptr, 1);
+	}
+	return kc;
+}
+
+/*
+ * Put the N blocks in OBJS in the current cpu's magazine for BLKTYPE,
+ * as far as they fit, and the rest back on their pages.
+ */
+static
+void
+kmag_fill(unsigned blktype, void **objs, unsigned n)
+{
+	struct kmcpu *kc;
+	struct kmagazine *mag;
+
+	kc = kmcpu_get(true);
+	if (kc != NULL) {
+		mag = &kc->kc_mags[blktype];
+		spinlock_acquire(&kc->kc_lock);
+		while (n > 0 && mag->km_count < kmag_size(blktype)) {
+			mag->km_objs[mag->km_count++] = objs[--n];
+		}
+		spinlock_release(&kc->kc_lock);
+	}
+	if (n > 0) {
+		subpage_putblocks(objs, n);
+	}
+}
+
+static
+void *
+subpage_kmalloc(size_t sz)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	struct kmcpu *kc;
+	struct kmagazine *mag;
+	void *objs[KMAG_MAX];
+	void *retptr;
+	unsigned n;
+
+	blktype = blocktype(sz);
+
+	kc = kmcpu_get(true);
+	if (kc != NULL) {
+		mag = &kc->kc_mags[blktype];
+		spinlock_acquire(&kc->kc_lock);
+		if (mag->km_count > 0) {
+			retptr = mag->km_objs[--mag->km_count];
+			spinlock_release(&kc->kc_lock);
+			return retptr;
+		}
+		spinlock_release(&kc->kc_lock);
+	}
+
+	/* The magazine is empty; keep one block and load the rest. */
+	n = subpage_getblocks(blktype, objs, kc ? kmag_batch(blktype) : 1);
+	if (n == 0) {
+		return NULL;
+	}
+	retptr = objs[--n];
+	if (n > 0) {
+		kmag_fill(blktype, objs, n);
+	}
+	return retptr;
+}
+
+static
+int
+subpage_kfree(void *ptr)
+{
+	int blktype;		// index into sizes[] that we're using
+	struct pageref *pr;	// pageref for page we're freeing in
+	struct kmcpu *kc;
+	struct kmagazine *mag;
+	void *objs[KMAG_MAX];
+	unsigned n, i;
+
+	pr = pageref_lookup((vaddr_t)ptr);
+	if (pr == NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype < NSIZES);
 
-	offset = ptraddr - prpage;
-
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+	/* Check for proper alignment (pages are aligned to every size) */
+	if ((vaddr_t)ptr % sizes[blktype] != 0) {
 		panic("kfree: subpage free of invalid addr %p\n", ptr);
 	}
 
@@ -558,48 +1175,73 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef(ptr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
+	kc = kmcpu_get(false);
+	if (kc == NULL) {
+		subpage_putblocks(&ptr, 1);
+		return 0;
+	}
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	mag = &kc->kc_mags[blktype];
+	spinlock_acquire(&kc->kc_lock);
+	if (mag->km_count < kmag_size(blktype)) {
+		mag->km_objs[mag->km_count++] = ptr;
+		spinlock_release(&kc->kc_lock);
+		return 0;
 	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+	/* Full; send the oldest blocks back to their pages. */
+	n = kmag_batch(blktype);
+	for (i=0; i<n; i++) {
+		objs[i] = mag->km_objs[i];
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+	for (i=n; i<mag->km_count; i++) {
+		mag->km_objs[i - n] = mag->km_objs[i];
 	}
+	mag->km_count -= n;
+	mag->km_objs[mag->km_count++] = ptr;
+	spinlock_release(&kc->kc_lock);
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
-	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
-	spinlock_release(&kmalloc_spinlock);
-#endif
-
+	subpage_putblocks(objs, n);
 	return 0;
 }
 
+/*
+ * Empty every cpu's magazines back onto the pages.
+ */
+static
+void
+kmag_drain(void)
+{
+	struct kmcpu *kc;
+	struct kmagazine *mag;
+	void *objs[KMAG_MAX];
+	unsigned i, j, n;
+
+	for (i=0; i<MAXCPUS; i++) {
+		kc = kmalloc_cpus[i];
+		if (kc == NULL) {
+			continue;
+		}
+		for (j=0; j<NSIZES; j++) {
+			mag = &kc->kc_mags[j];
+			spinlock_acquire(&kc->kc_lock);
+			n = mag->km_count;
+			memcpy(objs, mag->km_objs, n * sizeof(objs[0]));
+			mag->km_count = 0;
+			spinlock_release(&kc->kc_lock);
+			if (n > 0) {
+				subpage_putblocks(objs, n);
+			}
+		}
+	}
+}
+
 //
 ////////////////////////////////////////////////////////////
 
+static
 void *
-kmalloc(size_t sz)
+kmalloc_raw(size_t sz)
 {
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
@@ -618,8 +1260,9 @@ kmalloc(size_t sz)
 	return subpage_kmalloc(sz);
 }
 
+static
 void
-kfree(void *ptr)
+kfree_raw(void *ptr)
 {
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
@@ -632,3 +1275,116 @@ kfree(void *ptr)
 	}
 }
 
+#if OPT_KMALLOCPROF
+/*
+ * Work out which size class a kmalloc_raw of RAW bytes uses, and how
+ * many bytes it really takes.
+ */
+static
+unsigned
+kprof_class(size_t raw, size_t *rounded)
+{
+	unsigned cls;
+
+	if (raw >= LARGEST_SUBPAGE_SIZE) {
+		*rounded = ROUNDUP(raw, PAGE_SIZE);
+		return NSIZES;
+	}
+	cls = blocktype(raw);
+	*rounded = sizes[cls];
+	return cls;
+}
+#endif
+
+void *
+kmalloc(size_t sz)
+{
+#if OPT_KMALLOCPROF
+	struct kprof_hdr *hdr;
+	size_t rounded;
+	unsigned cls;
+
+	cls = kprof_class(sz + sizeof(*hdr), &rounded);
+	hdr = kmalloc_raw(sz + sizeof(*hdr));
+	if (hdr == NULL) {
+		return NULL;
+	}
+	kprof_charge(hdr, sz, (vaddr_t)__builtin_return_address(0),
+		     cls, rounded);
+	return hdr + 1;
+#else
+	return kmalloc_raw(sz);
+#endif
+}
+
+void
+kfree(void *ptr)
+{
+#if OPT_KMALLOCPROF
+	struct kprof_hdr *hdr;
+	size_t rounded;
+	unsigned cls;
+
+	if (ptr == NULL) {
+		return;
+	}
+	hdr = (struct kprof_hdr *)ptr - 1;
+	if (hdr->kh_magic != KPROF_MAGIC) {
+		panic("kfree: %p not allocated, or freed twice\n", ptr);
+	}
+	cls = kprof_class(hdr->kh_size + sizeof(*hdr), &rounded);
+	kprof_uncharge(hdr, cls, rounded);
+	ptr = hdr;
+#endif
+	kfree_raw(ptr);
+}
+
+size_t
+kmalloc_size(size_t sz)
+{
+#if OPT_KMALLOCPROF
+	sz += sizeof(struct kprof_hdr);
+#endif
+	if (sz >= LARGEST_SUBPAGE_SIZE) {
+		return ROUNDUP(sz, PAGE_SIZE);
+	}
+	return sizes[blocktype(sz)];
+}
+
+void
+kheap_reclaim(void)
+{
+	struct pageref *pr, *next;
+	struct freelist *dead, *fl;
+	int blktype;
+
+	/* Blocks in magazines would keep their pages from emptying. */
+	kmag_drain();
+
+	/* Chain the pages through their first words while we hold the lock. */
+	dead = NULL;
+	spinlock_acquire(&kmalloc_spinlock);
+	for (pr = allbase; pr != NULL; pr = next) {
+		next = pr->next_all;
+		blktype = PR_BLOCKTYPE(pr);
+		if (pr->nfree != PAGE_SIZE / sizes[blktype]) {
+			continue;
+		}
+		fl = (struct freelist *)PR_PAGEADDR(pr);
+		remove_lists(pr, blktype);
+		freepageref(pr);
+		KASSERT(nempty[blktype] > 0);
+		nempty[blktype]--;
+		pages_returned++;
+		fl->next = dead;
+		dead = fl;
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	/* free_kpages can sleep, so not under kmalloc_spinlock. */
+	while (dead != NULL) {
+		fl = dead;
+		dead = fl->next;
+		free_kpages((vaddr_t)fl);
+	}
+}
@@ -0,0 +1,393 @@
+/*
+ * Object caches. See kmemcache.h.
+ *
+ * Each slab is one page from alloc_kpages. The slab header is at the
+ * start of the page, so kmem_cache_free finds it by masking the
+ * object's address. After the header comes an array of free-list
+ * links, one for each object, and then the objects themselves. The
+ * free list lives in that array rather than in the free objects, so
+ * it doesn't clobber their constructed state.
+ *
+ * A cache keeps its slabs on three lists: partly used, full, and
+ * empty. Allocation prefers partly used slabs, to keep the others
+ * empty so they can be given back. Up to KMEM_RESERVE empty slabs
+ * are kept so a cache that is alternately allocated from and freed
+ * to doesn't make and destroy a slab each time; kmem_cache_reap gives
+ * those back too.
+ *
+ * Each cache has a spinlock for its slabs and counters. kmem_lock
+ * protects the list of caches, and is taken before any cache's lock.
+ * Constructors and destructors are called without either lock.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmemcache.h>
+
+#define KMEM_ALIGN    8		/* object alignment */
+#define KMEM_RESERVE  1		/* empty slabs to keep per cache */
+
+#define KSLAB_NONE    0xffff	/* end of a slab's free list */
+
+struct kslab {
+	struct kslab *ks_next;		/* on one of the cache's lists */
+	struct kslab *ks_prev;
+	struct kmem_cache *ks_cache;	/* cache we belong to */
+	unsigned ks_inuse;		/* objects handed out */
+	unsigned ks_free;		/* first free object, or KSLAB_NONE */
+	/* uint16_t links[kc_perslab] follows */
+};
+
+#define KSLAB_LINKS(ks) ((uint16_t *)((ks) + 1))
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			/* object size, rounded to KMEM_ALIGN */
+	size_t kc_offset;		/* where the objects start in a slab */
+	unsigned kc_perslab;		/* objects in each slab */
+	void (*kc_ctor)(void *);
+	void (*kc_dtor)(void *);
+
+	struct spinlock kc_lock;
+	struct kslab *kc_partial;	/* slabs with some objects free */
+	struct kslab *kc_full;		/* slabs with no objects free */
+	struct kslab *kc_empty;		/* slabs with every object free */
+	unsigned kc_nempty;		/* slabs on kc_empty */
+	unsigned kc_nslabs;		/* slabs in all */
+	unsigned kc_inuse;		/* objects handed out */
+	unsigned kc_allocs;		/* calls to kmem_cache_alloc */
+
+	struct kmem_cache *kc_next;	/* on kmem_caches */
+};
+
+static struct kmem_cache *kmem_caches;
+static struct spinlock kmem_lock = SPINLOCK_INITIALIZER;
+
+////////////////////////////////////////////////////////////
+//
+// Slabs
+
+static
+void
+kslab_insert(struct kslab **list, struct kslab *ks)
+{
+	ks->ks_prev = NULL;
+	ks->ks_next = *list;
+	if (*list != NULL) {
+		(*list)->ks_prev = ks;
+	}
+	*list = ks;
+}
+
+static
+void
+kslab_remove(struct kslab **list, struct kslab *ks)
+{
+	if (ks->ks_prev != NULL) {
+		ks->ks_prev->ks_next = ks->ks_next;
+	}
+	else {
+		KASSERT(*list == ks);
+		*list = ks->ks_next;
+	}
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prev = ks->ks_prev;
+	}
+	ks->ks_next = ks->ks_prev = NULL;
+}
+
+static
+void *
+kslab_obj(struct kmem_cache *kc, struct kslab *ks, unsigned index)
+{
+	return (char *)ks + kc->kc_offset + index * kc->kc_size;
+}
+
+/*
+ * Make a new slab, with every object constructed and free. Called
+ * without the cache's lock.
+ */
+static
+struct kslab *
+kslab_create(struct kmem_cache *kc)
+{
+	struct kslab *ks;
+	uint16_t *links;
+	vaddr_t page;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+
+	ks = (struct kslab *)page;
+	ks->ks_next = ks->ks_prev = NULL;
+	ks->ks_cache = kc;
+	ks->ks_inuse = 0;
+	ks->ks_free = 0;
+
+	links = KSLAB_LINKS(ks);
+	for (i=0; i<kc->kc_perslab; i++) {
+		links[i] = (i + 1 < kc->kc_perslab) ? i + 1 : KSLAB_NONE;
+		if (kc->kc_ctor != NULL) {
+			kc->kc_ctor(kslab_obj(kc, ks, i));
+		}
+	}
+	return ks;
+}
+
+/*
+ * Destroy a slab nobody is using that is on none of the lists. Called
+ * without the cache's lock.
+ */
+static
+void
+kslab_destroy(struct kmem_cache *kc, struct kslab *ks)
+{
+	unsigned i;
+
+	KASSERT(ks->ks_cache == kc);
+	KASSERT(ks->ks_inuse == 0);
+
+	if (kc->kc_dtor != NULL) {
+		for (i=0; i<kc->kc_perslab; i++) {
+			kc->kc_dtor(kslab_obj(kc, ks, i));
+		}
+	}
+	ks->ks_cache = NULL;
+	free_kpages((vaddr_t)ks);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Caches
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size,
+		  void (*ctor)(void *), void (*dtor)(void *))
+{
+	struct kmem_cache *kc;
+	size_t hdr;
+	unsigned n;
+
+	KASSERT(size > 0 && size <= KMEM_MAXSIZE);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+
+	kc->kc_name = name;
+	kc->kc_size = ROUNDUP(size, KMEM_ALIGN);
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+
+	/* Fit as many objects as we can along with their links. */
+	n = (PAGE_SIZE - sizeof(struct kslab)) /
+		(kc->kc_size + sizeof(uint16_t));
+	while (1) {
+		hdr = ROUNDUP(sizeof(struct kslab) + n * sizeof(uint16_t),
+			      KMEM_ALIGN);
+		if (hdr + n * kc->kc_size <= PAGE_SIZE) {
+			break;
+		}
+		n--;
+	}
+	KASSERT(n > 0 && n < KSLAB_NONE);
+	kc->kc_perslab = n;
+	kc->kc_offset = hdr;
+
+	spinlock_init(&kc->kc_lock);
+	kc->kc_partial = kc->kc_full = kc->kc_empty = NULL;
+	kc->kc_nempty = 0;
+	kc->kc_nslabs = 0;
+	kc->kc_inuse = 0;
+	kc->kc_allocs = 0;
+
+	spinlock_acquire(&kmem_lock);
+	kc->kc_next = kmem_caches;
+	kmem_caches = kc;
+	spinlock_release(&kmem_lock);
+
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **p;
+	struct kslab *ks;
+
+	KASSERT(kc->kc_inuse == 0);
+	KASSERT(kc->kc_partial == NULL);
+	KASSERT(kc->kc_full == NULL);
+
+	spinlock_acquire(&kmem_lock);
+	for (p = &kmem_caches; *p != kc; p = &(*p)->kc_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = kc->kc_next;
+	spinlock_release(&kmem_lock);
+
+	while ((ks = kc->kc_empty) != NULL) {
+		kslab_remove(&kc->kc_empty, ks);
+		kslab_destroy(kc, ks);
+	}
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kslab *ks;
+	uint16_t *links;
+	unsigned index;
+
+	spinlock_acquire(&kc->kc_lock);
+
+	ks = kc->kc_partial;
+	if (ks == NULL && kc->kc_empty != NULL) {
+		ks = kc->kc_empty;
+		kslab_remove(&kc->kc_empty, ks);
+		kc->kc_nempty--;
+		kslab_insert(&kc->kc_partial, ks);
+	}
+	if (ks == NULL) {
+		/* Make a new slab; alloc_kpages and the ctor want no lock. */
+		spinlock_release(&kc->kc_lock);
+		ks = kslab_create(kc);
+		if (ks == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		kc->kc_nslabs++;
+		kslab_insert(&kc->kc_partial, ks);
+	}
+
+	KASSERT(ks->ks_free != KSLAB_NONE);
+	links = KSLAB_LINKS(ks);
+	index = ks->ks_free;
+	ks->ks_free = links[index];
+	ks->ks_inuse++;
+	if (ks->ks_free == KSLAB_NONE) {
+		kslab_remove(&kc->kc_partial, ks);
+		kslab_insert(&kc->kc_full, ks);
+	}
+
+	kc->kc_inuse++;
+	kc->kc_allocs++;
+	spinlock_release(&kc->kc_lock);
+
+	return kslab_obj(kc, ks, index);
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kslab *ks;
+	vaddr_t offset;
+	unsigned index;
+	bool wasfull;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	ks = (struct kslab *)((vaddr_t)obj & PAGE_FRAME);
+	offset = (vaddr_t)obj - (vaddr_t)ks;
+	if (ks->ks_cache != kc || offset < kc->kc_offset ||
+	    (offset - kc->kc_offset) % kc->kc_size != 0) {
+		panic("kmem_cache_free: %p is not from cache %s\n",
+		      obj, kc->kc_name);
+	}
+	index = (offset - kc->kc_offset) / kc->kc_size;
+	KASSERT(index < kc->kc_perslab);
+
+	spinlock_acquire(&kc->kc_lock);
+
+	KASSERT(ks->ks_inuse > 0);
+	wasfull = (ks->ks_free == KSLAB_NONE);
+	KSLAB_LINKS(ks)[index] = ks->ks_free;
+	ks->ks_free = index;
+	ks->ks_inuse--;
+	kc->kc_inuse--;
+
+	if (ks->ks_inuse == 0) {
+		kslab_remove(wasfull ? &kc->kc_full : &kc->kc_partial, ks);
+		if (kc->kc_nempty < KMEM_RESERVE) {
+			kslab_insert(&kc->kc_empty, ks);
+			kc->kc_nempty++;
+			ks = NULL;
+		}
+		else {
+			kc->kc_nslabs--;
+		}
+	}
+	else {
+		if (wasfull) {
+			kslab_remove(&kc->kc_full, ks);
+			kslab_insert(&kc->kc_partial, ks);
+		}
+		ks = NULL;
+	}
+
+	spinlock_release(&kc->kc_lock);
+
+	if (ks != NULL) {
+		kslab_destroy(kc, ks);
+	}
+}
+
+void
+kmem_cache_reap(void)
+{
+	struct kmem_cache *kc;
+	struct kslab *ks, *dead;
+
+	/* Collect the empty slabs, chained through ks_next. */
+	dead = NULL;
+	spinlock_acquire(&kmem_lock);
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		while ((ks = kc->kc_empty) != NULL) {
+			kslab_remove(&kc->kc_empty, ks);
+			kc->kc_nempty--;
+			kc->kc_nslabs--;
+			ks->ks_next = dead;
+			dead = ks;
+		}
+		spinlock_release(&kc->kc_lock);
+	}
+	spinlock_release(&kmem_lock);
+
+	/* Destructors and free_kpages can sleep, so no locks. */
+	while (dead != NULL) {
+		ks = dead;
+		dead = ks->ks_next;
+		kslab_destroy(ks->ks_cache, ks);
+	}
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	spinlock_acquire(&kmem_lock);
+	kprintf("Object caches:\n");
+	kprintf("  %-16s %5s %5s %6s %6s %8s\n",
+		"name", "size", "slab", "slabs", "inuse", "allocs");
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		kprintf("  %-16s %5u %5u %6u %6u %8u\n", kc->kc_name,
+			(unsigned)kc->kc_size, kc->kc_perslab,
+			kc->kc_nslabs, kc->kc_inuse, kc->kc_allocs);
+		spinlock_release(&kc->kc_lock);
+	}
+	spinlock_release(&kmem_lock);
+}
@@ -0,0 +1,342 @@
+/*
+ * Page cache for shared file mappings. See pagecache.h.
+ *
+ * The cache is a hash table of pcpages, protected by pc_lock. While a
+ * page is being read in, or taken away by the page-out daemon, it is
+ * marked busy, and anyone else looking for it waits on pc_wchan, so a
+ * page is only ever read once and nobody maps a page being evicted.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <uio.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <coremap.h>
+#include <swap.h>
+#include <pagecache.h>
+
+#define PC_NBUCKETS  64
+
+struct pcpage {
+	struct vnode *pc_vn;
+	off_t pc_offset;
+	paddr_t pc_paddr;
+	bool pc_busy;			/* being read in or evicted */
+	struct pcpage *pc_next;		/* next in hash chain */
+};
+
+static struct pcpage *pc_table[PC_NBUCKETS];
+static struct spinlock pc_lock = SPINLOCK_INITIALIZER;
+static struct wchan *pc_wchan;
+
+static
+unsigned
+pc_hash(struct vnode *vn, off_t offset)
+{
+	return ((uintptr_t)vn / sizeof(void *) +
+		(unsigned)(offset / PAGE_SIZE)) % PC_NBUCKETS;
+}
+
+/*
+ * Look up a page. Call with pc_lock held.
+ */
+static
+struct pcpage *
+pc_find(struct vnode *vn, off_t offset)
+{
+	struct pcpage *pcp;
+
+	for (pcp = pc_table[pc_hash(vn, offset)]; pcp != NULL;
+	     pcp = pcp->pc_next) {
+		if (pcp->pc_vn == vn && pcp->pc_offset == offset) {
+			return pcp;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take a page out of the table. Call with pc_lock held.
+ */
+static
+void
+pc_remove(struct pcpage *pcp)
+{
+	struct pcpage **pp;
+
+	for (pp = &pc_table[pc_hash(pcp->pc_vn, pcp->pc_offset)];
+	     *pp != pcp; pp = &(*pp)->pc_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = pcp->pc_next;
+}
+
+/*
+ * Fill the frame at PADDR from VN at OFFSET, zero-filling past EOF.
+ */
+static
+int
+pc_read(struct vnode *vn, off_t offset, paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio u;
+	struct stat st;
+	char *page;
+	size_t len;
+	int result;
+
+	result = VOP_STAT(vn, &st);
+	if (result) {
+		return result;
+	}
+
+	page = (char *)PADDR_TO_KVADDR(paddr);
+	len = 0;
+	if (offset < st.st_size) {
+		len = st.st_size - offset < PAGE_SIZE ?
+			st.st_size - offset : PAGE_SIZE;
+	}
+	bzero(page + len, PAGE_SIZE - len);
+	if (len == 0) {
+		return 0;
+	}
+
+	uio_kinit(&iov, &u, page, len, offset, UIO_READ);
+	result = VOP_READ(vn, &u);
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+void
+pagecache_bootstrap(void)
+{
+	pc_wchan = wchan_create("pagecache");
+	if (pc_wchan == NULL) {
+		panic("pagecache: wchan_create failed\n");
+	}
+}
+
+int
+pagecache_get(struct vnode *vn, off_t offset, paddr_t *ret, bool *hit)
+{
+	struct pcpage *pcp, *new;
+	paddr_t pa;
+	int result;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	spinlock_acquire(&pc_lock);
+	for (;;) {
+		pcp = pc_find(vn, offset);
+		if (pcp == NULL) {
+			break;
+		}
+		if (!pcp->pc_busy) {
+			coremap_share(pcp->pc_paddr);
+			*ret = pcp->pc_paddr;
+			*hit = true;
+			spinlock_release(&pc_lock);
+			return 0;
+		}
+		wchan_lock(pc_wchan);
+		spinlock_release(&pc_lock);
+		wchan_sleep(pc_wchan);
+		spinlock_acquire(&pc_lock);
+	}
+	spinlock_release(&pc_lock);
+
+	/* Not there; make an entry and read it in. */
+	new = kmalloc(sizeof(*new));
+	if (new == NULL) {
+		return ENOMEM;
+	}
+	pa = swap_getpage();
+	if (pa == 0) {
+		kfree(new);
+		return ENOMEM;
+	}
+	new->pc_vn = vn;
+	new->pc_offset = offset;
+	new->pc_paddr = pa;
+	new->pc_busy = true;
+
+	spinlock_acquire(&pc_lock);
+	if (pc_find(vn, offset) != NULL) {
+		/* Someone beat us to it; use theirs. */
+		spinlock_release(&pc_lock);
+		coremap_free(pa);
+		kfree(new);
+		return pagecache_get(vn, offset, ret, hit);
+	}
+	new->pc_next = pc_table[pc_hash(vn, offset)];
+	pc_table[pc_hash(vn, offset)] = new;
+	spinlock_release(&pc_lock);
+
+	VOP_INCREF(vn);
+	result = pc_read(vn, offset, pa);
+
+	spinlock_acquire(&pc_lock);
+	new->pc_busy = false;
+	if (result) {
+		pc_remove(new);
+	}
+	else {
+		coremap_share(pa);
+		coremap_setcached(pa);
+	}
+	spinlock_release(&pc_lock);
+	wchan_wakeall(pc_wchan);
+
+	if (result) {
+		VOP_DECREF(vn);
+		coremap_free(pa);
+		kfree(new);
+		return result;
+	}
+	*ret = pa;
+	*hit = false;
+	return 0;
+}
+
+int
+pagecache_writeback(struct vnode *vn, off_t offset, paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio u;
+	struct stat st;
+	size_t len;
+	int result;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	/* Don't extend the file with whatever is past EOF. */
+	result = VOP_STAT(vn, &st);
+	if (result) {
+		return result;
+	}
+	if (offset >= st.st_size) {
+		return 0;
+	}
+	len = st.st_size - offset < PAGE_SIZE ?
+		st.st_size - offset : PAGE_SIZE;
+
+	uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(paddr), len, offset,
+		  UIO_WRITE);
+	result = VOP_WRITE(vn, &u);
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+void
+pagecache_reclaim(void)
+{
+	struct pcpage *pcp, **pp, *dead;
+	unsigned i;
+
+	dead = NULL;
+	spinlock_acquire(&pc_lock);
+	for (i=0; i<PC_NBUCKETS; i++) {
+		pp = &pc_table[i];
+		while (*pp != NULL) {
+			pcp = *pp;
+			/*
+			 * New references are only taken under pc_lock,
+			 * so a page only we hold stays that way.
+			 */
+			if (pcp->pc_busy ||
+			    coremap_refcount(pcp->pc_paddr) > 1) {
+				pp = &pcp->pc_next;
+				continue;
+			}
+			*pp = pcp->pc_next;
+			pcp->pc_next = dead;
+			dead = pcp;
+		}
+	}
+	spinlock_release(&pc_lock);
+
+	while (dead != NULL) {
+		pcp = dead;
+		dead = pcp->pc_next;
+		coremap_free(pcp->pc_paddr);
+		VOP_DECREF(pcp->pc_vn);
+		kfree(pcp);
+	}
+}
+
+int
+pagecache_evict(paddr_t paddr)
+{
+	struct pcpage *pcp;
+	unsigned i;
+	bool dirty, gone;
+	int result;
+
+	/* Nothing maps it by address, so look through the whole table. */
+	spinlock_acquire(&pc_lock);
+	pcp = NULL;
+	for (i=0; i<PC_NBUCKETS && pcp == NULL; i++) {
+		for (pcp = pc_table[i]; pcp != NULL; pcp = pcp->pc_next) {
+			if (pcp->pc_paddr == paddr) {
+				break;
+			}
+		}
+	}
+	if (pcp == NULL || pcp->pc_busy) {
+		/* pagecache_reclaim got there first. */
+		spinlock_release(&pc_lock);
+		coremap_unpin(paddr);
+		return EAGAIN;
+	}
+	pcp->pc_busy = true;
+	spinlock_release(&pc_lock);
+
+	/* Once nobody has it mapped, nobody can be changing it. */
+	dirty = as_dropshared(paddr);
+	if (dirty) {
+		result = pagecache_writeback(pcp->pc_vn, pcp->pc_offset,
+					     paddr);
+		if (result) {
+			kprintf("pagecache: writeback failed: %s\n",
+				strerror(result));
+		}
+	}
+
+	/*
+	 * Someone may have got it from us just before it was marked
+	 * busy, and not mapped it yet; then it has to stay.
+	 */
+	spinlock_acquire(&pc_lock);
+	gone = coremap_refcount(paddr) == 1;
+	if (gone) {
+		pc_remove(pcp);
+	}
+	pcp->pc_busy = false;
+	spinlock_release(&pc_lock);
+	wchan_wakeall(pc_wchan);
+
+	coremap_unpin(paddr);
+	if (!gone) {
+		return EAGAIN;
+	}
+	coremap_free(paddr);
+	VOP_DECREF(pcp->pc_vn);
+	kfree(pcp);
+	return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * Two-level page table. See pagetable.h.
+ *
+ * The second-level tables are exactly one page each, so they are
+ * allocated directly with alloc_kpages rather than going through
+ * kmalloc's size classes.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <pagetable.h>
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(*pt));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i=0; i<PT_NENTRIES; i++) {
+		pt->pt_l2[i] = NULL;
+	}
+	return pt;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned i;
+
+	for (i=0; i<PT_NENTRIES; i++) {
+		if (pt->pt_l2[i] != NULL) {
+			free_kpages((vaddr_t)pt->pt_l2[i]);
+		}
+	}
+	kfree(pt);
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	unsigned l1;
+	vaddr_t l2page;
+
+	l1 = PT_L1INDEX(vaddr);
+	if (pt->pt_l2[l1] == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		l2page = alloc_kpages(1);
+		if (l2page == 0) {
+			return NULL;
+		}
+		bzero((void *)l2page, PAGE_SIZE);
+		pt->pt_l2[l1] = (pte_t *)l2page;
+	}
+	return &pt->pt_l2[l1][PT_L2INDEX(vaddr)];
+}
+
+int
+pt_walk(struct pagetable *pt, pt_walkfn func, void *data)
+{
+	unsigned l1, l2;
+	pte_t *l2table;
+	int result;
+
+	for (l1=0; l1<PT_NENTRIES; l1++) {
+		l2table = pt->pt_l2[l1];
+		if (l2table == NULL) {
+			continue;
+		}
+		for (l2=0; l2<PT_NENTRIES; l2++) {
+			if (l2table[l2] == 0) {
+				continue;
+			}
+			result = func(PT_VADDR(l1, l2), &l2table[l2], data);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,292 @@
+/*
+ * Shared memory segments. See shm.h.
+ *
+ * shm_lock protects the segment table, the reference counts, the
+ * frame arrays and the count of frames in use. A segment's id is its
+ * index in the table.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/shm.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <coremap.h>
+#include <swap.h>
+#include <shm.h>
+
+struct shmseg {
+	int sh_key;			/* name, or IPC_PRIVATE */
+	bool sh_named;			/* still findable by key or id */
+	unsigned sh_refs;		/* mappings, plus one if named */
+	size_t sh_npages;
+	paddr_t *sh_pages;		/* frames, or 0 if not touched yet */
+};
+
+static struct shmseg *shm_table[SHM_MAXSEGS];
+static struct spinlock shm_lock = SPINLOCK_INITIALIZER;
+static unsigned shm_nframes;		/* frames held by all segments */
+static unsigned shm_maxframes;
+
+/*
+ * Free a segment nobody refers to any more.
+ */
+static
+void
+shm_destroy(struct shmseg *seg)
+{
+	size_t i;
+	unsigned n;
+
+	KASSERT(seg->sh_refs == 0);
+	n = 0;
+	for (i=0; i<seg->sh_npages; i++) {
+		if (seg->sh_pages[i] != 0) {
+			coremap_free(seg->sh_pages[i]);
+			n++;
+		}
+	}
+	kfree(seg->sh_pages);
+	kfree(seg);
+
+	spinlock_acquire(&shm_lock);
+	KASSERT(shm_nframes >= n);
+	shm_nframes -= n;
+	spinlock_release(&shm_lock);
+}
+
+void
+shm_bootstrap(void)
+{
+	/* Nearly everything is free this early in boot. */
+	shm_maxframes = coremap_freecount() / SHM_MEMFRAC;
+}
+
+int
+shm_get(int key, size_t size, int flags, int *id)
+{
+	struct shmseg *seg;
+	int slot, result;
+
+	/* Look for it by name first. */
+	spinlock_acquire(&shm_lock);
+	if (key != IPC_PRIVATE) {
+		for (slot=0; slot<SHM_MAXSEGS; slot++) {
+			seg = shm_table[slot];
+			if (seg == NULL || seg->sh_key != key) {
+				continue;
+			}
+			if ((flags & IPC_CREAT) && (flags & IPC_EXCL)) {
+				spinlock_release(&shm_lock);
+				return EEXIST;
+			}
+			if (size > seg->sh_npages * PAGE_SIZE) {
+				spinlock_release(&shm_lock);
+				return EINVAL;
+			}
+			*id = slot;
+			spinlock_release(&shm_lock);
+			return 0;
+		}
+		if ((flags & IPC_CREAT) == 0) {
+			spinlock_release(&shm_lock);
+			return ENOENT;
+		}
+	}
+	spinlock_release(&shm_lock);
+
+	/* Make a new one. */
+	result = shm_create(size, &seg);
+	if (result) {
+		return result;
+	}
+	seg->sh_key = key;
+	seg->sh_named = true;
+
+	spinlock_acquire(&shm_lock);
+	for (slot=0; slot<SHM_MAXSEGS; slot++) {
+		if (shm_table[slot] == NULL) {
+			continue;
+		}
+		if (key != IPC_PRIVATE && shm_table[slot]->sh_key == key) {
+			/* Someone made it while we weren't looking. */
+			spinlock_release(&shm_lock);
+			seg->sh_refs = 0;
+			shm_destroy(seg);
+			return shm_get(key, size, flags, id);
+		}
+	}
+	for (slot=0; slot<SHM_MAXSEGS; slot++) {
+		if (shm_table[slot] == NULL) {
+			break;
+		}
+	}
+	if (slot == SHM_MAXSEGS) {
+		spinlock_release(&shm_lock);
+		seg->sh_refs = 0;
+		shm_destroy(seg);
+		return ENOSPC;
+	}
+	shm_table[slot] = seg;
+	spinlock_release(&shm_lock);
+
+	*id = slot;
+	return 0;
+}
+
+int
+shm_create(size_t size, struct shmseg **ret)
+{
+	struct shmseg *seg;
+	size_t npages, i;
+
+	if (size == 0 || size > SHM_MAXPAGES * PAGE_SIZE) {
+		return EINVAL;
+	}
+	npages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	seg = kmalloc(sizeof(*seg));
+	if (seg == NULL) {
+		return ENOMEM;
+	}
+	seg->sh_pages = kmalloc(npages * sizeof(paddr_t));
+	if (seg->sh_pages == NULL) {
+		kfree(seg);
+		return ENOMEM;
+	}
+	for (i=0; i<npages; i++) {
+		seg->sh_pages[i] = 0;
+	}
+	seg->sh_key = IPC_PRIVATE;
+	seg->sh_named = false;
+	seg->sh_refs = 1;
+	seg->sh_npages = npages;
+
+	*ret = seg;
+	return 0;
+}
+
+int
+shm_lookup(int id, struct shmseg **ret, size_t *npages)
+{
+	struct shmseg *seg;
+
+	if (id < 0 || id >= SHM_MAXSEGS) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&shm_lock);
+	seg = shm_table[id];
+	if (seg == NULL) {
+		spinlock_release(&shm_lock);
+		return EINVAL;
+	}
+	seg->sh_refs++;
+	spinlock_release(&shm_lock);
+
+	*ret = seg;
+	*npages = seg->sh_npages;
+	return 0;
+}
+
+void
+shm_incref(struct shmseg *seg)
+{
+	spinlock_acquire(&shm_lock);
+	KASSERT(seg->sh_refs > 0);
+	seg->sh_refs++;
+	spinlock_release(&shm_lock);
+}
+
+void
+shm_decref(struct shmseg *seg)
+{
+	spinlock_acquire(&shm_lock);
+	KASSERT(seg->sh_refs > 0);
+	seg->sh_refs--;
+	if (seg->sh_refs > 0) {
+		spinlock_release(&shm_lock);
+		return;
+	}
+	/* Unnamed, or the name would hold a reference. */
+	KASSERT(!seg->sh_named);
+	spinlock_release(&shm_lock);
+
+	shm_destroy(seg);
+}
+
+int
+shm_getpage(struct shmseg *seg, unsigned index, paddr_t *ret, bool *hit)
+{
+	paddr_t pa;
+
+	KASSERT(index < seg->sh_npages);
+
+	spinlock_acquire(&shm_lock);
+	KASSERT(seg->sh_refs > 0);
+	pa = seg->sh_pages[index];
+	if (pa != 0) {
+		coremap_share(pa);
+		spinlock_release(&shm_lock);
+		*ret = pa;
+		*hit = true;
+		return 0;
+	}
+	if (shm_nframes >= shm_maxframes) {
+		spinlock_release(&shm_lock);
+		return ENOMEM;
+	}
+	/* Count it now, so others can't go past the limit meanwhile. */
+	shm_nframes++;
+	spinlock_release(&shm_lock);
+
+	pa = swap_getpage();
+	if (pa == 0) {
+		spinlock_acquire(&shm_lock);
+		shm_nframes--;
+		spinlock_release(&shm_lock);
+		return ENOMEM;
+	}
+	bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+
+	spinlock_acquire(&shm_lock);
+	if (seg->sh_pages[index] != 0) {
+		/* Someone else got there first; use theirs. */
+		shm_nframes--;
+		spinlock_release(&shm_lock);
+		coremap_free(pa);
+		return shm_getpage(seg, index, ret, hit);
+	}
+	/* One reference for the segment and one for the caller. */
+	seg->sh_pages[index] = pa;
+	coremap_share(pa);
+	spinlock_release(&shm_lock);
+
+	*ret = pa;
+	*hit = false;
+	return 0;
+}
+
+int
+shm_remove(int id)
+{
+	struct shmseg *seg;
+
+	if (id < 0 || id >= SHM_MAXSEGS) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&shm_lock);
+	seg = shm_table[id];
+	if (seg == NULL) {
+		spinlock_release(&shm_lock);
+		return EINVAL;
+	}
+	shm_table[id] = NULL;
+	seg->sh_named = false;
+	spinlock_release(&shm_lock);
+
+	shm_decref(seg);
+	return 0;
+}
@@ -0,0 +1,631 @@
+/*
+ * Swap space and the page-out daemon. See swap.h.
+ *
+ * Paging a page out goes like this:
+ *
+ *    1. coremap_pickvictim chooses a frame and pins it, so its owner
+ *       can't free it (or go away) underneath us. If the frame was
+ *       shared copy-on-write, the coremap doesn't know the owner any
+ *       more, and as_findowner looks for it.
+ *    2. Under the owner's as_lock, check the PTE still maps the frame,
+ *       and hasn't been loaded into the TLB since the clock last came
+ *       by (PTE_ACCESSED, which the UTLB refill handler sets; if it
+ *       has, clear it and leave the page for another time). Pin the
+ *       pages after it that can go out too (a cluster).
+ *       Get consecutive slots for them, mark them PTE_BUSY, and shoot
+ *       down their TLB entries, waiting (after dropping the lock) for
+ *       other CPUs to do so too. From here on the owner can't use the
+ *       pages; if it faults on one, it waits in swap_waitbusy.
+ *    3. Write the cluster to its slots in one request, with no locks
+ *       held.
+ *    4. Under as_lock again, change the PTEs to point at the slots and
+ *       wake anyone waiting on busy pages.
+ *    5. Unpin and free the frames.
+ *
+ * Since neighbouring pages are usually used together, a fault on one
+ * page of a cluster reads the rest back as well (swap_readrun).
+ *
+ * A page holding unmodifiable file data (PTE_FILE) is just dropped:
+ * its PTE goes back to zero and it is read from the file again if
+ * it's needed. So is a page-cache frame, once pagecache_evict has
+ * written it back to its file.
+ *
+ * The daemon runs even without a swap disk, since it can still free
+ * those two kinds of page.
+ *
+ * With the zswap option, "writing" a page in step 3 first offers it to
+ * the compressed swap cache (zswap.h), and only the pages it doesn't
+ * take go to disk. Reads and frees check the cache first as well.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <kmemcache.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <swap.h>
+#include <zeropool.h>
+#include <pagecache.h>
+#include <uw-vmstats.h>
+#include "opt-zswap.h"
+#if OPT_ZSWAP
+#include <zswap.h>
+#endif
+
+static struct vnode *swap_vn;		/* NULL if no swap */
+static bool swap_running;		/* daemon started */
+static struct bitmap *swap_map;		/* in-use slots */
+static unsigned swap_nslots;
+
+/*
+ * swap_lock protects the slot bitmap and the daemon handshake. The
+ * daemon sleeps on swap_daemonwc until swap_wanted is set; threads
+ * out of memory sleep on swap_memwc until swap_passes changes.
+ */
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+static struct wchan *swap_daemonwc;
+static struct wchan *swap_memwc;
+static bool swap_wanted;
+static unsigned swap_passes;		/* completed daemon passes */
+static bool swap_progress;		/* did the last pass free anything */
+static unsigned swap_rotor;		/* where to look for free slots */
+
+/* For waiting on PTE_BUSY pages. */
+static struct wchan *swap_busywc;
+
+////////////////////////////////////////////////////////////
+//
+// Slots and I/O
+
+/*
+ * Allocate a run of up to WANT consecutive free slots. Returns the
+ * number gotten, which is the longest run there is if there's none
+ * of WANT, and 0 if swap is full. Allocation continues from where
+ * the last one left off, so successive clusters tend to go out in
+ * order.
+ */
+static
+unsigned
+swap_allocrun(unsigned want, unsigned *start)
+{
+	unsigned n, i, run, best;
+
+	KASSERT(want > 0);
+
+	spinlock_acquire(&swap_lock);
+	run = best = 0;
+	*start = 0;
+	for (n=0; n<swap_nslots && best<want; n++) {
+		i = (swap_rotor + n) % swap_nslots;
+		if (i == 0) {
+			/* Runs don't wrap around the end. */
+			run = 0;
+		}
+		if (bitmap_isset(swap_map, i)) {
+			run = 0;
+			continue;
+		}
+		run++;
+		if (run > best) {
+			best = run;
+			*start = i + 1 - run;
+		}
+	}
+	for (i=0; i<best; i++) {
+		bitmap_mark(swap_map, *start + i);
+	}
+	if (best > 0) {
+		swap_rotor = (*start + best) % swap_nslots;
+	}
+	spinlock_release(&swap_lock);
+	return best;
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+#if OPT_ZSWAP
+	/* Before the slot can be reused. */
+	zswap_drop(slot);
+#endif
+	spinlock_acquire(&swap_lock);
+	KASSERT(bitmap_isset(swap_map, slot));
+	bitmap_unmark(swap_map, slot);
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * Transfer the N consecutive slots starting at SLOT to or from the
+ * frames in PAS, as a single request to the disk.
+ */
+static
+int
+swap_io(unsigned slot, const paddr_t *pas, unsigned n, enum uio_rw rw)
+{
+	struct iovec iov[SWAP_CLUSTER];
+	struct uio u;
+	unsigned i;
+	int result;
+
+	KASSERT(n > 0 && n <= SWAP_CLUSTER);
+	KASSERT(slot + n <= swap_nslots);
+
+	for (i=0; i<n; i++) {
+		iov[i].iov_kbase = (void *)PADDR_TO_KVADDR(pas[i]);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	u.uio_iov = iov;
+	u.uio_iovcnt = n;
+	u.uio_offset = (off_t)slot * PAGE_SIZE;
+	u.uio_resid = n * PAGE_SIZE;
+	u.uio_segflg = UIO_SYSSPACE;
+	u.uio_rw = rw;
+	u.uio_space = NULL;
+
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vn, &u);
+	}
+	else {
+		result = VOP_WRITE(swap_vn, &u);
+	}
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+/*
+ * Do the I/O for the N consecutive slots starting at SLOT: first let
+ * the compressed cache handle whatever pages it can, then transfer
+ * each run of the others in one go. Disk writes are charged to PROC.
+ */
+static
+int
+swap_iorun(unsigned slot, const paddr_t *pas, unsigned n, enum uio_rw rw,
+	   struct proc *proc)
+{
+	bool cached[SWAP_CLUSTER];
+	unsigned i, j;
+	int result;
+
+	KASSERT(n > 0 && n <= SWAP_CLUSTER);
+
+	for (i=0; i<n; i++) {
+#if OPT_ZSWAP
+		if (rw == UIO_READ) {
+			cached[i] = zswap_load(slot + i, pas[i]);
+			if (!cached[i]) {
+				vmstats_inc(VMSTAT_ZSWAP_MISS);
+			}
+		}
+		else {
+			cached[i] = zswap_store(slot + i, pas[i]);
+		}
+#else
+		cached[i] = false;
+#endif
+	}
+
+	for (i=0; i<n; i=j) {
+		if (cached[i]) {
+			j = i + 1;
+			continue;
+		}
+		for (j=i+1; j<n && !cached[j]; j++) {
+			/* nothing */
+		}
+		if (rw == UIO_WRITE) {
+			vmstats_addproc(proc, VMSTAT_SWAP_FILE_WRITE, j - i);
+		}
+		result = swap_io(slot + i, pas + i, j - i, rw);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+int
+swap_read(unsigned slot, paddr_t paddr)
+{
+	return swap_iorun(slot, &paddr, 1, UIO_READ, NULL);
+}
+
+int
+swap_readrun(unsigned slot, const paddr_t *pas, unsigned n)
+{
+	return swap_iorun(slot, pas, n, UIO_READ, NULL);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Busy pages
+
+void
+swap_waitbusy(struct addrspace *as)
+{
+	KASSERT(spinlock_do_i_hold(&as->as_lock));
+
+	wchan_lock(swap_busywc);
+	spinlock_release(&as->as_lock);
+	wchan_sleep(swap_busywc);
+	spinlock_acquire(&as->as_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Page-out
+
+/*
+ * Gather the resident neighbours of the victim page VADDR of AS,
+ * which is at PA, into a cluster that can be written to consecutive
+ * slots: the run of following pages that are private, unpinned and
+ * not recently used, up to SWAP_CLUSTER in all. The victim goes in
+ * VAS[0] and PAS[0]. Call with as_lock held and the victim's PTE
+ * checked; returns the number of pages, all pinned.
+ */
+static
+unsigned
+swap_gather(struct addrspace *as, vaddr_t vaddr, paddr_t pa,
+	    vaddr_t *vas, paddr_t *pas)
+{
+	pte_t *pte;
+	unsigned n;
+
+	KASSERT(spinlock_do_i_hold(&as->as_lock));
+
+	/*
+	 * Only the owner may look at the region list, so go by the
+	 * PTEs alone; it doesn't matter if the run crosses into
+	 * another region.
+	 */
+	vas[0] = vaddr;
+	pas[0] = pa;
+	for (n=1; n<SWAP_CLUSTER; n++) {
+		vas[n] = vaddr + n * PAGE_SIZE;
+		if (vas[n] >= USERSPACETOP) {
+			break;
+		}
+		pte = pt_lookup(as->as_pt, vas[n], false);
+		if (pte == NULL ||
+		    (*pte & (PTE_VALID | PTE_BUSY | PTE_FILE | PTE_SHARED))
+		    != PTE_VALID) {
+			break;
+		}
+		if (*pte & PTE_ACCESSED) {
+			/* In use; it gets its second chance. */
+			*pte &= ~PTE_ACCESSED;
+			break;
+		}
+		pas[n] = *pte & PTE_FRAME;
+		if (!coremap_trypin(pas[n], as, vas[n])) {
+			break;
+		}
+	}
+	return n;
+}
+
+/*
+ * Page out a victim and as many of its neighbours as will go with it
+ * (see swap_gather). Returns 0 if any frames were freed, EAGAIN if
+ * the victim turned out to be unsuitable, or another error if nothing
+ * can be paged out.
+ */
+static
+int
+swap_evict(void)
+{
+	struct addrspace *as;
+	struct tlbbatch tb;
+	vaddr_t vaddr, vas[SWAP_CLUSTER];
+	paddr_t pa, pas[SWAP_CLUSTER];
+	pte_t *pte;
+	unsigned slot, n, got, i;
+	bool cached;
+	int result;
+
+	pa = coremap_pickvictim(&as, &vaddr, &cached);
+	if (pa == 0) {
+		return ENOMEM;
+	}
+	if (cached) {
+		return pagecache_evict(pa);
+	}
+	if (as == NULL) {
+		/* The last copy of a copy-on-write page; whose is it? */
+		as = as_findowner(pa, vaddr);
+		if (as == NULL) {
+			coremap_unpin(pa);
+			return EAGAIN;
+		}
+		coremap_setowner(pa, as, vaddr);
+		coremap_clearref(pa);
+	}
+
+	spinlock_acquire(&as->as_lock);
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	if (pte == NULL || (*pte & PTE_BUSY) ||
+	    (*pte & (PTE_VALID | PTE_FRAME)) != (pa | PTE_VALID)) {
+		/* The owner changed it since the coremap was updated. */
+		spinlock_release(&as->as_lock);
+		coremap_unpin(pa);
+		return EAGAIN;
+	}
+	if (*pte & PTE_ACCESSED) {
+		/* Used since the clock last passed; give it another go. */
+		*pte &= ~PTE_ACCESSED;
+		spinlock_release(&as->as_lock);
+		coremap_unpin(pa);
+		return EAGAIN;
+	}
+	vm_tlbbatch_init(&tb);
+	if (*pte & PTE_FILE) {
+		/* No need to write it; it can be read from the file again. */
+		*pte = 0;
+		vm_tlbbatch_add(&tb, as, vaddr);
+		spinlock_release(&as->as_lock);
+		vm_tlbbatch_finish(&tb);
+		coremap_unpin(pa);
+		coremap_free(pa);
+		return 0;
+	}
+	if (swap_vn == NULL) {
+		/* Nowhere to put it. */
+		spinlock_release(&as->as_lock);
+		coremap_unpin(pa);
+		return EAGAIN;
+	}
+
+	n = swap_gather(as, vaddr, pa, vas, pas);
+	got = swap_allocrun(n, &slot);
+	for (i=got; i<n; i++) {
+		/* Couldn't get slots for all of them; keep the rest. */
+		coremap_unpin(pas[i]);
+	}
+	if (got == 0) {
+		spinlock_release(&as->as_lock);
+		return ENOSPC;
+	}
+	n = got;
+	for (i=0; i<n; i++) {
+		pte = pt_lookup(as->as_pt, vas[i], false);
+		*pte |= PTE_BUSY;
+		vm_tlbbatch_add(&tb, as, vas[i]);
+	}
+	spinlock_release(&as->as_lock);
+
+	/* Nobody can still be writing to them once this returns. */
+	vm_tlbbatch_finish(&tb);
+
+	/* The pinned frames keep AS, and so its process, around. */
+	result = swap_iorun(slot, pas, n, UIO_WRITE, as->as_proc);
+
+	spinlock_acquire(&as->as_lock);
+	for (i=0; i<n; i++) {
+		pte = pt_lookup(as->as_pt, vas[i], false);
+		if (result) {
+			/* Leave them resident. */
+			*pte &= ~PTE_BUSY;
+		}
+		else {
+			*pte = PTE_MKSLOT(slot + i) | PTE_SWAPPED;
+		}
+	}
+	spinlock_release(&as->as_lock);
+	wchan_wakeall(swap_busywc);
+
+	for (i=0; i<n; i++) {
+		coremap_unpin(pas[i]);
+		if (result) {
+			swap_free(slot + i);
+		}
+		else {
+			coremap_free(pas[i]);
+		}
+	}
+	if (result) {
+		kprintf("swap: write error: %s\n", strerror(result));
+		return result;
+	}
+	return 0;
+}
+
+void
+swap_reclaim(void)
+{
+	/* Slab destructors may kfree, so the slabs go before kmalloc. */
+	zeropool_drain();
+	pagecache_reclaim();
+	kmem_cache_reap();
+	kheap_reclaim();
+}
+
+static
+void
+swap_daemon(void *unused1, unsigned long unused2)
+{
+	unsigned tries;
+	bool progress;
+	int result;
+
+	(void)unused1;
+	(void)unused2;
+
+	spinlock_acquire(&swap_lock);
+	for (;;) {
+		while (!swap_wanted) {
+			wchan_lock(swap_daemonwc);
+			spinlock_release(&swap_lock);
+			wchan_sleep(swap_daemonwc);
+			spinlock_acquire(&swap_lock);
+		}
+		swap_wanted = false;
+		spinlock_release(&swap_lock);
+
+		/* Give back what's cheap to first. */
+		swap_reclaim();
+
+		progress = false;
+		tries = 0;
+		while (coremap_freecount() < SWAP_HIWATER &&
+		       tries < SWAP_HIWATER * 2) {
+			result = swap_evict();
+			if (result == 0) {
+				progress = true;
+			}
+			else if (result != EAGAIN && result != ENOSPC) {
+				/* With swap full, cached pages can still go. */
+				break;
+			}
+			tries++;
+		}
+
+		spinlock_acquire(&swap_lock);
+		swap_progress = progress;
+		swap_passes++;
+		wchan_wakeall(swap_memwc);
+	}
+}
+
+void
+swap_kick(void)
+{
+	if (!swap_running) {
+		return;
+	}
+	spinlock_acquire(&swap_lock);
+	swap_wanted = true;
+	spinlock_release(&swap_lock);
+	wchan_wakeone(swap_daemonwc);
+}
+
+paddr_t
+swap_getpage(void)
+{
+	paddr_t pa;
+	unsigned passes;
+	bool progress;
+
+	for (;;) {
+		pa = coremap_alloc(1);
+		if (coremap_freecount() < SWAP_LOWATER) {
+			swap_kick();
+		}
+		if (pa != 0) {
+			return pa;
+		}
+
+		/* Out of memory: take back what's cheap right away. */
+		swap_reclaim();
+		pa = coremap_alloc(1);
+		if (pa != 0 || !swap_running) {
+			return pa;
+		}
+
+		/* Still out: wait for the daemon to make a pass. */
+		spinlock_acquire(&swap_lock);
+		swap_wanted = true;
+		wchan_wakeone(swap_daemonwc);
+		passes = swap_passes;
+		while (swap_passes == passes) {
+			wchan_lock(swap_memwc);
+			spinlock_release(&swap_lock);
+			wchan_sleep(swap_memwc);
+			spinlock_acquire(&swap_lock);
+		}
+		progress = swap_progress;
+		spinlock_release(&swap_lock);
+
+		if (!progress) {
+			/* One last try, in case something else freed memory. */
+			return coremap_alloc(1);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Setup
+
+/*
+ * Open the swap disk and set up its slots, if there is one.
+ */
+static
+void
+swap_opendisk(void)
+{
+	char path[sizeof(SWAP_DEVICE)];
+	struct stat st;
+	int result;
+
+	/* vfs_open destroys the string it's passed. */
+	strcpy(path, SWAP_DEVICE);
+	result = vfs_open(path, O_RDWR, 0, &swap_vn);
+	if (result) {
+		kprintf("swap: %s: %s; no swapping\n", SWAP_DEVICE,
+			strerror(result));
+		swap_vn = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vn, &st);
+	if (result) {
+		panic("swap: stat %s: %s\n", SWAP_DEVICE, strerror(result));
+	}
+	swap_nslots = st.st_size / PAGE_SIZE;
+	if (swap_nslots == 0) {
+		kprintf("swap: %s is too small; no swapping\n", SWAP_DEVICE);
+		vfs_close(swap_vn);
+		swap_vn = NULL;
+		return;
+	}
+	swap_map = bitmap_create(swap_nslots);
+	if (swap_map == NULL) {
+		panic("swap: Out of memory\n");
+	}
+#if OPT_ZSWAP
+	zswap_bootstrap(swap_nslots);
+#endif
+
+	kprintf("swap: %s, %u pages\n", SWAP_DEVICE, swap_nslots);
+}
+
+void
+swap_bootstrap(void)
+{
+	int result;
+
+	swap_busywc = wchan_create("swapbusy");
+	swap_daemonwc = wchan_create("swapdaemon");
+	swap_memwc = wchan_create("swapmem");
+	if (swap_busywc == NULL || swap_daemonwc == NULL ||
+	    swap_memwc == NULL) {
+		panic("swap: wchan_create failed\n");
+	}
+
+	swap_opendisk();
+
+	/* Even with no swap, it can drop clean and cached pages. */
+	result = thread_fork("pageout", NULL, swap_daemon, NULL, 0);
+	if (result) {
+		panic("swap: thread_fork: %s\n", strerror(result));
+	}
+	swap_running = true;
+}
@@ -10,14 +10,30 @@
  * with '_' ensure atomicity locally.
  */
 
+/* The counters are kept per CPU, and each increment only touches the
+ * current CPU's (with interrupts off), so vmstats_inc doesn't need
+ * stats_lock at all; the totals are the sums over the CPUs. Each
+ * process also has its own copy (p_vmstats in struct proc), which is
+ * charged for whatever the current thread does; work done by kernel
+ * threads shows up under kproc, unless it is on some process's behalf
+ * and charged to it with vmstats_addproc, as the page-out daemon's
+ * swap writes are. Counters of a process being charged from several
+ * CPUs at once can lose an occasional increment.
+ */
+
 #include <types.h>
 #include <lib.h>
 #include <synch.h>
 #include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <proc.h>
+#include <vm.h>
+#include <platform/maxcpus.h>
 #include <uw-vmstats.h>
 
 /* Counters for tracking statistics */
-static unsigned int stats_counts[VMSTAT_COUNT];
+static unsigned int stats_counts[MAXCPUS][VMSTAT_COUNT];
 
 struct spinlock stats_lock = SPINLOCK_INITIALIZER;
 
@@ -33,6 +49,16 @@ static const char *stats_names[] = {
  /*  7 */ "Page Faults from ELF",
  /*  8 */ "Page Faults from Swapfile",
  /*  9 */ "Swapfile Writes",
+ /* 10 */ "Pre-zeroed Page Hits",
+ /* 11 */ "Pre-zeroed Page Misses",
+ /* 12 */ "TLB Fault-around Loads",
+ /* 13 */ "Remote TLB Shootdowns",
+ /* 14 */ "Pages Prefetched",
+ /* 15 */ "Compressed Swap Stores",
+ /* 16 */ "Compressed Zero Pages",
+ /* 17 */ "Compressed Swap Bytes",
+ /* 18 */ "Compressed Swap Hits",
+ /* 19 */ "Compressed Swap Misses",
 };
 
 
@@ -41,9 +67,59 @@ static const char *stats_names[] = {
 void
 vmstats_inc(unsigned int index)
 {
-    spinlock_acquire(&stats_lock);
-      _vmstats_inc(index);
-    spinlock_release(&stats_lock);
+  int spl;
+
+  spl = splhigh();
+    _vmstats_inc(index);
+  splx(spl);
+}
+
+/* ---------------------------------------------------------------------- */
+/* Assumes vmstat_init has already been called */
+void
+vmstats_add(unsigned int index, unsigned int n)
+{
+  int spl;
+
+  spl = splhigh();
+    _vmstats_add(index, n);
+  splx(spl);
+}
+
+/* ---------------------------------------------------------------------- */
+void
+vmstats_addproc(struct proc *proc, unsigned int index, unsigned int n)
+{
+  int spl;
+
+  KASSERT(index < VMSTAT_COUNT);
+  spl = splhigh();
+    stats_counts[curcpu->c_number][index] += n;
+    if (proc != NULL) {
+      proc->p_vmstats[index] += n;
+    }
+  splx(spl);
+}
+
+/* ---------------------------------------------------------------------- */
+unsigned int
+vmstats_get(unsigned int index)
+{
+  unsigned int i, total = 0;
+
+  KASSERT(index < VMSTAT_COUNT);
+  for (i=0; i<MAXCPUS; i++) {
+    total += stats_counts[i][index];
+  }
+  return total;
+}
+
+/* ---------------------------------------------------------------------- */
+const char *
+vmstats_name(unsigned int index)
+{
+  KASSERT(index < VMSTAT_COUNT);
+  return stats_names[index];
 }
 
 /* ---------------------------------------------------------------------- */
@@ -63,9 +139,20 @@ vmstats_init(void)
 /* ---------------------------------------------------------------------- */
 void
 _vmstats_inc(unsigned int index)
+{
+  _vmstats_add(index, 1);
+}
+
+/* ---------------------------------------------------------------------- */
+void
+_vmstats_add(unsigned int index, unsigned int n)
 {
   KASSERT(index < VMSTAT_COUNT);
-  stats_counts[index]++;
+  KASSERT(curthread->t_iplhigh_count > 0);
+  stats_counts[curcpu->c_number][index] += n;
+  if (curproc != NULL) {
+    curproc->p_vmstats[index] += n;
+  }
 }
 
 /* ---------------------------------------------------------------------- */
@@ -80,8 +167,8 @@ _vmstats_init(void)
     panic("Should really fix this before proceeding\n");
   }
 
-  for (i=0; i<VMSTAT_COUNT; i++) {
-    stats_counts[i] = 0;
+  for (i=0; i<MAXCPUS; i++) {
+    bzero(stats_counts[i], sizeof(stats_counts[i]));
   }
 
 }
@@ -102,18 +189,25 @@ vmstats_print(void)
   int tlb_faults = 0;
   int elf_plus_swap_reads = 0;
   int disk_reads = 0;
+  unsigned int compressed = 0;
+  unsigned int swap_reads = 0;
+  unsigned int stats_totals[VMSTAT_COUNT];
+
+  for (i=0; i<VMSTAT_COUNT; i++) {
+    stats_totals[i] = vmstats_get(i);
+  }
 
   kprintf("VMSTATS:\n");
   for (i=0; i<VMSTAT_COUNT; i++) {
-    kprintf("VMSTAT %25s = %10d\n", stats_names[i], stats_counts[i]);
+    kprintf("VMSTAT %25s = %10d\n", stats_names[i], stats_totals[i]);
   }
 
-  tlb_faults = stats_counts[VMSTAT_TLB_FAULT];
-  free_plus_replace = stats_counts[VMSTAT_TLB_FAULT_FREE] + stats_counts[VMSTAT_TLB_FAULT_REPLACE];
-  disk_plus_zeroed_plus_reload = stats_counts[VMSTAT_PAGE_FAULT_DISK] +
-    stats_counts[VMSTAT_PAGE_FAULT_ZERO] + stats_counts[VMSTAT_TLB_RELOAD];
-  elf_plus_swap_reads = stats_counts[VMSTAT_ELF_FILE_READ] + stats_counts[VMSTAT_SWAP_FILE_READ];
-  disk_reads = stats_counts[VMSTAT_PAGE_FAULT_DISK];
+  tlb_faults = stats_totals[VMSTAT_TLB_FAULT];
+  free_plus_replace = stats_totals[VMSTAT_TLB_FAULT_FREE] + stats_totals[VMSTAT_TLB_FAULT_REPLACE];
+  disk_plus_zeroed_plus_reload = stats_totals[VMSTAT_PAGE_FAULT_DISK] +
+    stats_totals[VMSTAT_PAGE_FAULT_ZERO] + stats_totals[VMSTAT_TLB_RELOAD];
+  elf_plus_swap_reads = stats_totals[VMSTAT_ELF_FILE_READ] + stats_totals[VMSTAT_SWAP_FILE_READ];
+  disk_reads = stats_totals[VMSTAT_PAGE_FAULT_DISK];
 
   kprintf("VMSTAT TLB Faults with Free + TLB Faults with Replace = %d\n", free_plus_replace);
   if (tlb_faults != free_plus_replace) {
@@ -133,5 +227,18 @@ vmstats_print(void)
     kprintf("WARNING: ELF File reads + Swapfile reads != Page Faults (Disk) %d\n",
       elf_plus_swap_reads);
   }
+
+  /* Zero pages take no space, so leave them out of the ratio. */
+  compressed = stats_totals[VMSTAT_ZSWAP_STORE] - stats_totals[VMSTAT_ZSWAP_ZERO];
+  if (compressed > 0 && stats_totals[VMSTAT_ZSWAP_BYTES] > 0) {
+    kprintf("VMSTAT Compressed Swap ratio = %u%% of original size\n",
+      (unsigned int)((uint64_t)stats_totals[VMSTAT_ZSWAP_BYTES] * 100 /
+                     ((uint64_t)compressed * PAGE_SIZE)));
+  }
+  swap_reads = stats_totals[VMSTAT_ZSWAP_HIT] + stats_totals[VMSTAT_ZSWAP_MISS];
+  if (swap_reads > 0) {
+    kprintf("VMSTAT Compressed Swap hit rate = %u%%\n",
+      stats_totals[VMSTAT_ZSWAP_HIT] * 100 / swap_reads);
+  }
 }
 /* ---------------------------------------------------------------------- */
@@ -0,0 +1,240 @@
+/*
+ * Kernel virtual allocator. See vmalloc.h.
+ *
+ * vmalloc_map[i] says what is at page i of the window:
+ *    0           - nothing; free.
+ *    VMP_NOFRAME - taken, but no frame: the guard page after each
+ *                  allocation, or a page whose frame vmalloc hasn't
+ *                  got yet.
+ *    otherwise   - the physical address of its frame.
+ *
+ * vmalloc_lock covers finding free pages and the statistics. Entries
+ * only go from free to taken or back with it held. In between they
+ * belong to whoever allocated them, who fills in the frames without
+ * the lock; vm_fault reads them without it too, which is safe because
+ * nothing touches a block before vmalloc returns it or after it is
+ * passed to vfree. The guard page is what vfree uses to find the end.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <vmalloc.h>
+
+#define VMP_NOFRAME  1
+#define VMP_MAPPED(e)  ((e) != 0 && (e) != VMP_NOFRAME)
+
+static paddr_t vmalloc_map[VMALLOC_NPAGES];
+static struct spinlock vmalloc_lock = SPINLOCK_INITIALIZER;
+
+static unsigned vmalloc_inuse;		/* pages with frames */
+static unsigned vmalloc_nblocks;	/* live allocations */
+static unsigned vmalloc_allocs;		/* successful vmallocs */
+static unsigned vmalloc_fails;		/* failed vmallocs */
+
+/*
+ * Find NPAGES free pages in a row and mark them taken. Returns the
+ * index of the first, or VMALLOC_NPAGES if there is no such run.
+ */
+static
+unsigned
+vmalloc_reserve(unsigned npages)
+{
+	unsigned start, i;
+
+	KASSERT(spinlock_do_i_hold(&vmalloc_lock));
+
+	start = 0;
+	while (start + npages <= VMALLOC_NPAGES) {
+		for (i=0; i<npages; i++) {
+			if (vmalloc_map[start + i] != 0) {
+				break;
+			}
+		}
+		if (i == npages) {
+			for (i=0; i<npages; i++) {
+				vmalloc_map[start + i] = VMP_NOFRAME;
+			}
+			return start;
+		}
+		/* Skip past the page that was in the way. */
+		start += i + 1;
+	}
+	return VMALLOC_NPAGES;
+}
+
+/*
+ * Take away the NPAGES frames mapped from page START on, and give
+ * back those pages and the guard page after them.
+ */
+static
+void
+vmalloc_unmap(unsigned start, unsigned npages)
+{
+	struct tlbbatch tb;
+	unsigned i;
+
+	vm_tlbbatch_init(&tb);
+	for (i=0; i<npages; i++) {
+		vm_tlbbatch_addkernel(&tb, VMALLOC_BASE +
+				      (start + i) * PAGE_SIZE);
+	}
+	vm_tlbbatch_finish(&tb);
+
+	for (i=0; i<npages; i++) {
+		KASSERT(VMP_MAPPED(vmalloc_map[start + i]));
+		free_kpages(PADDR_TO_KVADDR(vmalloc_map[start + i]));
+	}
+
+	spinlock_acquire(&vmalloc_lock);
+	for (i=0; i<=npages; i++) {
+		vmalloc_map[start + i] = 0;
+	}
+	vmalloc_inuse -= npages;
+	spinlock_release(&vmalloc_lock);
+}
+
+void *
+vmalloc(size_t size)
+{
+	unsigned npages, start, i;
+	vaddr_t va;
+
+	if (size == 0 || size > (VMALLOC_NPAGES - 1) * PAGE_SIZE) {
+		return NULL;
+	}
+	npages = DIVROUNDUP(size, PAGE_SIZE);
+
+	spinlock_acquire(&vmalloc_lock);
+	start = vmalloc_reserve(npages + 1);
+	if (start == VMALLOC_NPAGES) {
+		vmalloc_fails++;
+		spinlock_release(&vmalloc_lock);
+		return NULL;
+	}
+	vmalloc_inuse += npages;
+	spinlock_release(&vmalloc_lock);
+
+	for (i=0; i<npages; i++) {
+		va = alloc_kpages(1);
+		if (va == 0) {
+			/*
+			 * Nothing can have touched these pages yet, so
+			 * the shootdown finds nothing; that's fine for a
+			 * path this rare. Page I counts as the guard.
+			 */
+			vmalloc_unmap(start, i);
+			spinlock_acquire(&vmalloc_lock);
+			vmalloc_inuse -= npages - i;
+			for (i++; i<=npages; i++) {
+				vmalloc_map[start + i] = 0;
+			}
+			vmalloc_fails++;
+			spinlock_release(&vmalloc_lock);
+			return NULL;
+		}
+		vmalloc_map[start + i] = KVADDR_TO_PADDR(va);
+	}
+
+	spinlock_acquire(&vmalloc_lock);
+	vmalloc_nblocks++;
+	vmalloc_allocs++;
+	spinlock_release(&vmalloc_lock);
+
+	return (void *)(VMALLOC_BASE + start * PAGE_SIZE);
+}
+
+void
+vfree(void *ptr)
+{
+	vaddr_t va;
+	unsigned start, npages;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+	va = (vaddr_t)ptr;
+	KASSERT(VMALLOC_ADDR(va));
+	KASSERT((va & PAGE_FRAME) == va);
+	start = (va - VMALLOC_BASE) / PAGE_SIZE;
+
+	/* It must be the start of a block: a guard or nothing before it. */
+	KASSERT(start == 0 || !VMP_MAPPED(vmalloc_map[start - 1]));
+	KASSERT(VMP_MAPPED(vmalloc_map[start]));
+
+	for (npages = 0; VMP_MAPPED(vmalloc_map[start + npages]); npages++) {
+		KASSERT(start + npages + 1 < VMALLOC_NPAGES);
+	}
+	KASSERT(vmalloc_map[start + npages] == VMP_NOFRAME);
+
+	vmalloc_unmap(start, npages);
+
+	spinlock_acquire(&vmalloc_lock);
+	KASSERT(vmalloc_nblocks > 0);
+	vmalloc_nblocks--;
+	spinlock_release(&vmalloc_lock);
+}
+
+void *
+kvmalloc(size_t size)
+{
+	if (size <= PAGE_SIZE) {
+		return kmalloc(size);
+	}
+	return vmalloc(size);
+}
+
+void
+kvfree(void *ptr)
+{
+	if (VMALLOC_ADDR(ptr)) {
+		vfree(ptr);
+	}
+	else {
+		kfree(ptr);
+	}
+}
+
+paddr_t
+vmalloc_lookup(vaddr_t vaddr)
+{
+	paddr_t pa;
+
+	if (!VMALLOC_ADDR(vaddr)) {
+		return 0;
+	}
+	pa = vmalloc_map[(vaddr - VMALLOC_BASE) / PAGE_SIZE];
+	if (!VMP_MAPPED(pa)) {
+		return 0;
+	}
+	return pa;
+}
+
+void
+vmalloc_printstats(void)
+{
+	unsigned i, nfree, run, maxrun;
+
+	spinlock_acquire(&vmalloc_lock);
+	nfree = maxrun = run = 0;
+	for (i=0; i<VMALLOC_NPAGES; i++) {
+		if (vmalloc_map[i] == 0) {
+			nfree++;
+			run++;
+			if (run > maxrun) {
+				maxrun = run;
+			}
+		}
+		else {
+			run = 0;
+		}
+	}
+	kprintf("vmalloc: %u blocks, %u pages mapped; %u allocs, "
+		"%u failed\n", vmalloc_nblocks, vmalloc_inuse,
+		vmalloc_allocs, vmalloc_fails);
+	kprintf("   %u of %u pages of address space free, "
+		"largest run %u\n", nfree, VMALLOC_NPAGES, maxrun);
+	spinlock_release(&vmalloc_lock);
+}
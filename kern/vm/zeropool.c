@@ -0,0 +1,120 @@
+/*
+ * Pre-zeroed page pool. See zeropool.h.
+ *
+ * Each pool has its own spinlock rather than relying on interrupts
+ * being off, because threads migrate between cpus and because the
+ * page-out daemon empties everyone's pool.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <platform/maxcpus.h>
+#include <vm.h>
+#include <coremap.h>
+#include <swap.h>
+#include <zeropool.h>
+#include <uw-vmstats.h>
+
+struct zeropool {
+	struct spinlock zp_lock;
+	paddr_t zp_pages[ZPOOL_HIWATER];
+	unsigned zp_count;
+};
+
+static struct zeropool zeropools[MAXCPUS];
+static bool zeropool_ready;
+
+void
+zeropool_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<MAXCPUS; i++) {
+		spinlock_init(&zeropools[i].zp_lock);
+		zeropools[i].zp_count = 0;
+	}
+	zeropool_ready = true;
+}
+
+paddr_t
+zeropool_get(void)
+{
+	struct zeropool *zp;
+	paddr_t pa;
+
+	pa = 0;
+	if (zeropool_ready) {
+		/* If we move to another cpu after this, it doesn't matter. */
+		zp = &zeropools[curcpu->c_number];
+		spinlock_acquire(&zp->zp_lock);
+		if (zp->zp_count > 0) {
+			pa = zp->zp_pages[--zp->zp_count];
+		}
+		spinlock_release(&zp->zp_lock);
+	}
+
+	vmstats_inc(pa != 0 ? VMSTAT_ZERO_POOL_HIT : VMSTAT_ZERO_POOL_MISS);
+	return pa;
+}
+
+bool
+zeropool_fill(void)
+{
+	struct zeropool *zp;
+	paddr_t pa;
+	bool full;
+
+	if (!zeropool_ready) {
+		return false;
+	}
+
+	/* Only this cpu's idle loop adds to its pool. */
+	zp = &zeropools[curcpu->c_number];
+	spinlock_acquire(&zp->zp_lock);
+	full = zp->zp_count >= ZPOOL_HIWATER;
+	spinlock_release(&zp->zp_lock);
+	if (full || coremap_freecount() <= ZPOOL_MINFREE) {
+		return false;
+	}
+
+	pa = coremap_alloc(1);
+	if (pa == 0) {
+		return false;
+	}
+	bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+
+	spinlock_acquire(&zp->zp_lock);
+	KASSERT(zp->zp_count < ZPOOL_HIWATER);
+	zp->zp_pages[zp->zp_count++] = pa;
+	spinlock_release(&zp->zp_lock);
+	return true;
+}
+
+void
+zeropool_drain(void)
+{
+	struct zeropool *zp;
+	paddr_t pa;
+	unsigned i;
+
+	if (!zeropool_ready) {
+		return;
+	}
+
+	for (i=0; i<MAXCPUS; i++) {
+		zp = &zeropools[i];
+		for (;;) {
+			spinlock_acquire(&zp->zp_lock);
+			if (zp->zp_count == 0) {
+				spinlock_release(&zp->zp_lock);
+				break;
+			}
+			pa = zp->zp_pages[--zp->zp_count];
+			spinlock_release(&zp->zp_lock);
+			coremap_free(pa);
+		}
+	}
+}
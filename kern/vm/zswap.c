@@ -0,0 +1,300 @@
+/*
+ * Compressed swap cache. See zswap.h.
+ *
+ * zswap_data[slot] is NULL if the slot's page is on disk (or the slot
+ * is free), ZSWAP_ZEROPAGE if the page is all zeros, and otherwise
+ * points at the compressed page, zswap_len[slot] bytes long. A slot's
+ * entry is set by the page-out daemon before the PTE is changed to
+ * point at the slot, and cleared by whoever frees the slot, so like
+ * the slot's contents on disk it needs no lock of its own; zswap_lock
+ * only covers the pool size. The pool size counts the kmalloc blocks
+ * the compressed pages are kept in, which are bigger than the pages
+ * themselves (kmalloc_size), since that is the memory really used.
+ *
+ * Compressed format: a control byte, whose bits (low first) say what
+ * each of the next eight items is, then the items. A 0 bit is a
+ * literal byte. A 1 bit is a match: two bytes holding a 12-bit
+ * distance back into the output and a 4-bit length code, which is the
+ * length less LZ_MINMATCH, or 15 to say a third byte follows with the
+ * rest. Matches may overlap the bytes they produce, so a run of one
+ * byte costs a literal and a match or two.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <coremap.h>
+#include <vmalloc.h>
+#include <zswap.h>
+#include <uw-vmstats.h>
+
+#define LZ_MINMATCH   3
+#define LZ_MAXMATCH   (LZ_MINMATCH + 15 + 255)
+#define LZ_HASHBITS   10
+#define LZ_HASH(p) \
+	((((uint32_t)(p)[0] << 16 | (uint32_t)(p)[1] << 8 | (p)[2]) * \
+	  2654435761U) >> (32 - LZ_HASHBITS))
+
+/* Marks an all-zero page; never dereferenced. */
+static char zswap_zeropage;
+#define ZSWAP_ZEROPAGE ((void *)&zswap_zeropage)
+
+static void **zswap_data;
+static uint16_t *zswap_len;
+static unsigned zswap_nslots;
+
+static struct spinlock zswap_lock = SPINLOCK_INITIALIZER;
+static size_t zswap_bytes;		/* bytes of kmalloc blocks held */
+static size_t zswap_maxbytes;
+
+/*
+ * Compressor state. Only the page-out daemon compresses, so these are
+ * never used by two threads at once. The hash table is a guess at
+ * where each three-byte string last appeared; entries left over from
+ * earlier pages are harmless, because matches are checked.
+ */
+static uint16_t lz_table[1 << LZ_HASHBITS];
+static uint8_t lz_buf[ZSWAP_MAXLEN];
+
+/*
+ * Compress the page SRC into DST. Returns the compressed length, or
+ * 0 if it would be more than MAX bytes.
+ */
+static
+size_t
+lz_compress(const uint8_t *src, uint8_t *dst, size_t max)
+{
+	size_t pos, out, ctl, len, off;
+	unsigned bit, h, cand;
+
+	pos = out = ctl = 0;
+	bit = 8;
+	while (pos < PAGE_SIZE) {
+		if (bit == 8) {
+			if (out >= max) {
+				return 0;
+			}
+			ctl = out++;
+			dst[ctl] = 0;
+			bit = 0;
+		}
+
+		len = 0;
+		cand = 0;
+		if (pos + LZ_MINMATCH <= PAGE_SIZE) {
+			h = LZ_HASH(src + pos);
+			cand = lz_table[h];
+			lz_table[h] = pos;
+			while (cand < pos && pos + len < PAGE_SIZE &&
+			       len < LZ_MAXMATCH &&
+			       src[cand + len] == src[pos + len]) {
+				len++;
+			}
+		}
+
+		if (len >= LZ_MINMATCH) {
+			if (out + 3 > max) {
+				return 0;
+			}
+			off = pos - cand;
+			KASSERT(off > 0 && off < PAGE_SIZE);
+			pos += len;
+			len -= LZ_MINMATCH;
+			dst[out++] = off >> 4;
+			if (len < 15) {
+				dst[out++] = (off & 0xf) << 4 | len;
+			}
+			else {
+				dst[out++] = (off & 0xf) << 4 | 15;
+				dst[out++] = len - 15;
+			}
+			dst[ctl] |= 1 << bit;
+		}
+		else {
+			if (out >= max) {
+				return 0;
+			}
+			dst[out++] = src[pos++];
+		}
+		bit++;
+	}
+	return out;
+}
+
+/*
+ * Undo lz_compress: expand the LEN bytes at SRC into the page DST.
+ */
+static
+void
+lz_decompress(const uint8_t *src, size_t len, uint8_t *dst)
+{
+	size_t in, pos, mlen, off;
+	unsigned bit, ctl;
+
+	in = pos = 0;
+	ctl = 0;
+	bit = 8;
+	while (pos < PAGE_SIZE) {
+		if (bit == 8) {
+			KASSERT(in < len);
+			ctl = src[in++];
+			bit = 0;
+		}
+		if (ctl & (1 << bit)) {
+			KASSERT(in + 2 <= len);
+			off = (size_t)src[in] << 4 | src[in + 1] >> 4;
+			mlen = src[in + 1] & 0xf;
+			in += 2;
+			if (mlen == 15) {
+				KASSERT(in < len);
+				mlen += src[in++];
+			}
+			mlen += LZ_MINMATCH;
+			KASSERT(off > 0 && off <= pos);
+			KASSERT(pos + mlen <= PAGE_SIZE);
+			for (; mlen > 0; mlen--, pos++) {
+				dst[pos] = dst[pos - off];
+			}
+		}
+		else {
+			KASSERT(in < len);
+			dst[pos++] = src[in++];
+		}
+		bit++;
+	}
+	KASSERT(in == len);
+}
+
+void
+zswap_bootstrap(unsigned nslots)
+{
+	unsigned i;
+
+	/* These run to several pages with a big swap disk. */
+	zswap_data = kvmalloc(nslots * sizeof(zswap_data[0]));
+	zswap_len = kvmalloc(nslots * sizeof(zswap_len[0]));
+	if (zswap_data == NULL || zswap_len == NULL) {
+		panic("zswap: Out of memory\n");
+	}
+	for (i=0; i<nslots; i++) {
+		zswap_data[i] = NULL;
+		zswap_len[i] = 0;
+	}
+	zswap_nslots = nslots;
+
+	/* Nearly everything is free this early in boot. */
+	zswap_maxbytes = coremap_freecount() / ZSWAP_POOLFRAC * PAGE_SIZE;
+
+	kprintf("zswap: up to %uK of compressed pages\n",
+		(unsigned)(zswap_maxbytes / 1024));
+}
+
+bool
+zswap_store(unsigned slot, paddr_t paddr)
+{
+	const uint32_t *words;
+	void *data;
+	size_t len, size;
+	unsigned i;
+
+	KASSERT(slot < zswap_nslots);
+	KASSERT(zswap_data[slot] == NULL);
+
+	words = (const uint32_t *)PADDR_TO_KVADDR(paddr);
+	for (i=0; i<PAGE_SIZE / sizeof(uint32_t); i++) {
+		if (words[i] != 0) {
+			break;
+		}
+	}
+	if (i == PAGE_SIZE / sizeof(uint32_t)) {
+		zswap_data[slot] = ZSWAP_ZEROPAGE;
+		vmstats_inc(VMSTAT_ZSWAP_STORE);
+		vmstats_inc(VMSTAT_ZSWAP_ZERO);
+		return true;
+	}
+
+	len = lz_compress((const uint8_t *)words, lz_buf, sizeof(lz_buf));
+	if (len == 0) {
+		return false;
+	}
+	size = kmalloc_size(len);
+	if (size >= PAGE_SIZE) {
+		/* Would take a whole page anyway. */
+		return false;
+	}
+
+	spinlock_acquire(&zswap_lock);
+	if (zswap_bytes + size > zswap_maxbytes) {
+		spinlock_release(&zswap_lock);
+		return false;
+	}
+	zswap_bytes += size;
+	spinlock_release(&zswap_lock);
+
+	data = kmalloc(len);
+	if (data == NULL) {
+		spinlock_acquire(&zswap_lock);
+		zswap_bytes -= size;
+		spinlock_release(&zswap_lock);
+		return false;
+	}
+	memcpy(data, lz_buf, len);
+	zswap_len[slot] = len;
+	zswap_data[slot] = data;
+
+	vmstats_inc(VMSTAT_ZSWAP_STORE);
+	vmstats_add(VMSTAT_ZSWAP_BYTES, size);
+	return true;
+}
+
+bool
+zswap_load(unsigned slot, paddr_t paddr)
+{
+	void *data;
+	uint8_t *page;
+
+	KASSERT(slot < zswap_nslots);
+
+	data = zswap_data[slot];
+	if (data == NULL) {
+		return false;
+	}
+
+	page = (uint8_t *)PADDR_TO_KVADDR(paddr);
+	if (data == ZSWAP_ZEROPAGE) {
+		bzero(page, PAGE_SIZE);
+	}
+	else {
+		lz_decompress(data, zswap_len[slot], page);
+	}
+	vmstats_inc(VMSTAT_ZSWAP_HIT);
+	return true;
+}
+
+void
+zswap_drop(unsigned slot)
+{
+	void *data;
+	size_t size;
+
+	KASSERT(slot < zswap_nslots);
+
+	data = zswap_data[slot];
+	if (data == NULL) {
+		return;
+	}
+	zswap_data[slot] = NULL;
+	if (data == ZSWAP_ZEROPAGE) {
+		return;
+	}
+
+	size = kmalloc_size(zswap_len[slot]);
+	spinlock_acquire(&zswap_lock);
+	KASSERT(zswap_bytes >= size);
+	zswap_bytes -= size;
+	spinlock_release(&zswap_lock);
+
+	/* kmalloc's pages are never pinned, so this won't sleep. */
+	kfree(data);
+}
@@ -0,0 +1,20 @@
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+/*
+ * Memory mapping.
+ */
+
+#include <sys/types.h>
+#include <kern/mman.h>
+
+/* What mmap returns on failure */
+#define MAP_FAILED ((void *)-1)
+
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int munmap(void *addr, size_t len);
+int msync(void *addr, size_t len, int flags);
+int madvise(void *addr, size_t len, int advice);
+int mincore(void *addr, size_t len, char *vec);
+
+#endif /* _SYS_MMAN_H_ */
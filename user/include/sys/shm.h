@@ -0,0 +1,20 @@
+#ifndef _SYS_SHM_H_
+#define _SYS_SHM_H_
+
+/*
+ * System V-style shared memory.
+ */
+
+#include <sys/types.h>
+#include <kern/shm.h>
+
+/*
+ * Only IPC_RMID is supported by shmctl, and there is no struct
+ * shmid_ds; pass NULL for the buffer.
+ */
+int shmget(int key, size_t size, int flags);
+void *shmat(int shmid, const void *addr, int flags);
+int shmdt(const void *addr);
+int shmctl(int shmid, int cmd, void *buf);
+
+#endif /* _SYS_SHM_H_ */
@@ -0,0 +1,178 @@
+/*
+ * shmtest - check System V shared memory.
+ *
+ * There is no fork to share a segment between processes with, so this
+ * attaches the same segment more than once in one process and checks
+ * that every attachment sees the same memory. It also checks that new
+ * segments are zero-filled, that keys find the same segment again,
+ * and that removed segments go away once they're detached. Last, it
+ * checks anonymous MAP_SHARED mmaps, which are segments underneath.
+ */
+
+#include <sys/types.h>
+#include <sys/shm.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGE     4096
+#define NPAGES   3
+#define TESTKEY  161
+
+/*
+ * Check that the NPAGES pages at A and B are the same memory.
+ */
+static
+void
+check_same(volatile unsigned *a, volatile unsigned *b, unsigned seed)
+{
+	unsigned i, n;
+
+	n = NPAGES * PAGE / sizeof(unsigned);
+	for (i=0; i<n; i++) {
+		a[i] = seed + i;
+	}
+	for (i=0; i<n; i++) {
+		if (b[i] != seed + i) {
+			errx(1, "Word %u is %u through the second attachment, "
+			     "not %u", i, b[i], seed + i);
+		}
+	}
+}
+
+static
+void
+test_attach(void)
+{
+	volatile unsigned *a, *b, *ro;
+	unsigned i;
+	int id;
+
+	id = shmget(IPC_PRIVATE, NPAGES * PAGE, IPC_CREAT);
+	if (id < 0) {
+		err(1, "shmget");
+	}
+
+	a = shmat(id, NULL, 0);
+	if (a == (void *)-1) {
+		err(1, "shmat");
+	}
+	b = shmat(id, NULL, 0);
+	if (b == (void *)-1) {
+		err(1, "shmat (second time)");
+	}
+	if (a == b) {
+		errx(1, "Both attachments are at %p", a);
+	}
+
+	for (i=0; i<NPAGES * PAGE / sizeof(unsigned); i++) {
+		if (b[i] != 0) {
+			errx(1, "New segment isn't zero-filled at word %u", i);
+		}
+	}
+	check_same(a, b, 0);
+	check_same(b, a, 12345);
+
+	ro = shmat(id, NULL, SHM_RDONLY);
+	if (ro == (void *)-1) {
+		err(1, "shmat read-only");
+	}
+	if (ro[NPAGES * PAGE / sizeof(unsigned) - 1] !=
+	    a[NPAGES * PAGE / sizeof(unsigned) - 1]) {
+		errx(1, "Read-only attachment sees different data");
+	}
+	if (shmdt((void *)ro) < 0) {
+		err(1, "shmdt read-only");
+	}
+
+	/* Removing it leaves it usable until the last detach. */
+	if (shmctl(id, IPC_RMID, NULL) < 0) {
+		err(1, "shmctl IPC_RMID");
+	}
+	if (shmdt((void *)b) < 0) {
+		err(1, "shmdt");
+	}
+	check_same(a, a, 999);
+	if (shmdt((void *)a) < 0) {
+		err(1, "shmdt (last)");
+	}
+
+	if (shmat(id, NULL, 0) != (void *)-1) {
+		errx(1, "shmat of a removed segment succeeded");
+	}
+	if (shmdt((void *)a) == 0) {
+		errx(1, "shmdt of a detached address succeeded");
+	}
+	printf("Attach test passed.\n");
+}
+
+static
+void
+test_keys(void)
+{
+	int id, id2;
+
+	id = shmget(TESTKEY, PAGE, IPC_CREAT | IPC_EXCL);
+	if (id < 0) {
+		err(1, "shmget %d", TESTKEY);
+	}
+	id2 = shmget(TESTKEY, PAGE, 0);
+	if (id2 < 0) {
+		err(1, "shmget %d again", TESTKEY);
+	}
+	if (id2 != id) {
+		errx(1, "Key %d gave ids %d and %d", TESTKEY, id, id2);
+	}
+	if (shmget(TESTKEY, PAGE, IPC_CREAT | IPC_EXCL) >= 0 ||
+	    errno != EEXIST) {
+		errx(1, "IPC_EXCL on an existing key didn't fail with EEXIST");
+	}
+	if (shmget(TESTKEY, 2 * PAGE, 0) >= 0) {
+		errx(1, "Asking for more than the segment's size worked");
+	}
+
+	if (shmctl(id, IPC_RMID, NULL) < 0) {
+		err(1, "shmctl IPC_RMID");
+	}
+	if (shmget(TESTKEY, PAGE, 0) >= 0 || errno != ENOENT) {
+		errx(1, "Removed key %d can still be found", TESTKEY);
+	}
+	printf("Key test passed.\n");
+}
+
+static
+void
+test_anon(void)
+{
+	volatile unsigned *a;
+	unsigned i, n;
+
+	a = mmap(NULL, NPAGES * PAGE, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANON, -1, 0);
+	if (a == MAP_FAILED) {
+		err(1, "mmap MAP_SHARED|MAP_ANON");
+	}
+	n = NPAGES * PAGE / sizeof(unsigned);
+	for (i=0; i<n; i++) {
+		if (a[i] != 0) {
+			errx(1, "Shared mapping isn't zero-filled at word %u",
+			     i);
+		}
+	}
+	check_same(a, a, 4242);
+	if (munmap((void *)a, NPAGES * PAGE) < 0) {
+		err(1, "munmap");
+	}
+	printf("Anonymous shared mapping test passed.\n");
+}
+
+int
+main(void)
+{
+	test_attach();
+	test_keys();
+	test_anon();
+	printf("shmtest done.\n");
+	return 0;
+}